@@ -1,15 +1,48 @@
+#ifdef _WIN32
+#include <windows.h>
+#endif
 #include <GL/glut.h>
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
 
 // This program will display a simulation of fish motion implementing Couzin's model
 
 #define DEG_TO_RAD 0.017453293
 #define PI 3.14159265358979323846
 
-#define MAX_FISH 1000
+#define FISH_CHUNK 1024 // Fish the storage of a species grows and shrinks by
+// Bits of fish.zones
+#define ZONE_ZOR 1
+#define ZONE_ZOO 2
+#define ZONE_ZOA 4
+
+#define SCHOOL_NONE -1 // Label of a fish that is not in a school
+#define SCHOOL_MERGED -2 // Marks a label as counted as merged during labelling
+#define MAX_PREDATORS 16
+#define MAX_RANKS 64 // Most processes a decomposed run can be split over
+#define RANK_CHUNK 256 // Fish a list of a decomposed run starts out holding
+#define BVH_LEAF_SIZE 4 // Most obstacles a hierarchy leaf holds
+#define MAX_STEPS_PER_FRAME 10 // Steps the scheduler may run back to back to catch up
 #define MAX_BOX_EDGE 50
 #define MIN_BOX_EDGE 25
 
@@ -17,9 +50,9 @@ struct fish {
     GLfloat position_v[3]; // x y z co-ordinates
     GLfloat direction_v[3]; //x y z co-ordinates unit vector for it's direction
     GLfloat next_direction_v[3]; // the vector direction_v will become.
-    int in_ZOR; // identifier for if another fish was in the ZOR
-    int in_ZOO; // identifier for if another fish was in the ZOO
-    int in_ZOA; // identifier for if another fish was in the ZOA
+    unsigned char zones; // ZONE_ZOR, ZONE_ZOO and ZONE_ZOA bits for the zones another fish was in
+    unsigned int id; // identifier of the fish within its species, used to key its random numbers
+    int school; // label of the school the fish belongs to, SCHOOL_NONE when alone
 };
 
 GLfloat  eyex, eyey, eyez;    // Eye point                                     
@@ -38,6 +71,8 @@ GLfloat matEmissive[] = { 0.0, 1.0, 0.0, 0.1 };
 
 GLfloat species1_colour[] = { 1.0,0.5,0.0,0.1 }; // Colour of species one (orange)
 GLfloat species2_colour[] = { 0.2,0.4,1.0,0.1 }; // Colour of species two (blue)
+GLfloat obstacle_colour[] = { 0.5,0.5,0.5,1.0 }; // Colour of the obstacles (grey)
+GLfloat predator_colour[] = { 0.9,0.1,0.1,1.0 }; // Colour of the predators (red)
 
 GLdouble blind_angle = 90.0; // Determines the volume in which a fish can't 'see' other fish within
 GLdouble blind_radian_segment; // blind_angle converted to a value that can be used in calculations 
@@ -45,9 +80,17 @@ GLdouble turning_angle_spec1 = 5.0; // The turning angle of species one
 GLdouble turning_angle_spec2 = 5.0; // The turning angle of species two
 GLdouble turning_radian_spec1; // turning_angle_spec1 converted to radians
 GLdouble turning_radian_spec2; // turning_angle_spec2 converted to radians
+GLdouble turning_angle_predator = 8.0; // The turning angle of the predators
+GLdouble turning_radian_predator; // turning_angle_predator converted to radians
 
 int fish1_count = 100; // Amount of species one fish in the scene
 int fish2_count = 100; // Amount of species two fish in the scene
+int fish1_capacity = 0; // Fish the storage of species one holds before it grows
+int fish2_capacity = 0; // Fish the storage of species two holds before it grows
+unsigned int fish1_next_id = 0; // Identifier of the next species one fish spawned
+unsigned int fish2_next_id = 0; // Identifier of the next species two fish spawned
+unsigned int fish1_despawns = 0; // Species one fish removed since the last restart, keying the next pick
+unsigned int fish2_despawns = 0; // Species two fish removed since the last restart, keying the next pick
 
 int ZOR_range_spec1[] = { 2,2 }; // Zone of repulsion range for species one {species one, species two}      
 int ZOO_range_spec1[] = { 10,0 }; // Zone of orientation range for species one {species one, species two}  
@@ -57,7 +100,7 @@ int ZOR_range_spec2[] = { 2,2 }; // Zone of repulsion range for species two {spe
 int ZOO_range_spec2[] = { 0,10 }; // Zone of orientation range for species two {species one, species two}
 int ZOA_range_spec2[] = { 0,20 }; // Zone of attraction range for species two {species one, species two}
 
-int hard_wall, pause; // Identifier for if the walls "wrap around" and if the simulation if paused
+int hard_wall, paused; // Identifier for if the walls "wrap around" and if the simulation if paused
 int two_species = 0; // Identifier for if the second species are activated
 
 GLfloat dist_from_scene; // Value used for the camera's viewpoint
@@ -65,6 +108,184 @@ GLfloat dist_from_scene; // Value used for the camera's viewpoint
 struct fish *f1; // Pointer for species one array
 struct fish *f2; // Pointer for species two array
 
+// Collective order of one species, accumulated while the fish are moved
+struct order_metrics {
+    int count; // number of fish the metrics were taken over
+    GLdouble polarisation; // length of the mean heading, 1 when every fish swims the same way
+    GLdouble milling; // normalised angular momentum about the centroid, 1 for a perfect torus
+    GLdouble centroid[3]; // mean position
+    GLdouble dispersion; // root mean square distance from the centroid
+};
+
+struct order_metrics order_spec1; // Order metrics of species one
+struct order_metrics order_spec2; // Order metrics of species two
+FILE *metrics_file = NULL; // Time series of the order metrics, NULL when not recorded
+
+// Schools are the connected groups of the graph of fish that interacted during a step.
+// Union-find nodes are species one's fish followed by species two's.
+int school_tracking = 1; // Identifier for if schools are detected each step
+int colour_schools = 0; // Identifier for if fish are coloured by school
+int school_capacity; // Number of nodes and labels the arrays below hold
+int school_nodes; // Number of nodes in use this step
+int *school_parent; // Union-find parent of each node
+int *school_size; // Number of nodes in the set of each root
+int *school_start; // Offset of each root's members in school_members
+int *school_fill; // Members placed so far for each root
+int *school_members; // Nodes grouped by root
+int *school_label_count; // Scratch count of members per previous label
+int *school_label_owner; // Root that keeps each label, SCHOOL_NONE when none
+int *school_best_label; // Label each root proposes to keep
+int *school_best_count; // Members of each root that had the proposed label
+int *school_root_label; // Label given to each root
+int school_next_label; // Where the search for a fresh label starts
+int school_count; // Schools found on the last step
+int largest_school; // Fish in the largest school on the last step
+int school_merges; // Schools that merged into another since the last restart
+int school_splits; // Schools that split off another since the last restart
+
+enum obstacle_type { OBSTACLE_SPHERE, OBSTACLE_BOX, OBSTACLE_TRIANGLE };
+
+struct obstacle {
+    int type; // one of obstacle_type
+    GLfloat v[3][3]; // sphere: centre, {radius}; box: min corner, max corner; triangle: corners
+    GLfloat lower[3], upper[3]; // bounding box
+};
+
+// Node of the bounding volume hierarchy over the obstacles
+struct bvh_node {
+    GLfloat lower[3], upper[3]; // bounding box of every obstacle below the node
+    int first; // leaf: first obstacle; inner node: right child (the left child is the next node)
+    int count; // number of obstacles in a leaf, 0 for an inner node
+};
+
+struct obstacle *obstacles; // Static obstacles, ordered by the hierarchy
+int obstacle_count, obstacle_capacity;
+struct bvh_node *bvh_nodes; // Hierarchy over the obstacles, the root first
+int bvh_node_count;
+int bvh_sort_axis; // Axis obstacles are sorted along while building the hierarchy
+GLfloat obstacle_range = 4.0; // Distance within which fish steer away from obstacles
+
+struct fish predators[MAX_PREDATORS]; // Predators, which chase the nearest fish
+int predator_count = 0; // Number of predators in the scene
+int scene_predators = 0; // Number of predators placed by the scene file
+GLfloat predator_start_v[MAX_PREDATORS][3]; // Start positions of the predators placed by the scene file
+GLfloat flee_radius = 15.0; // Distance within which fish flee from a predator
+struct order_metrics order_predators; // Unused order metrics of the predators
+
+int batch_steps = 0; // Number of steps of a headless run, 0 opens the window instead
+int ranks = 1; // Number of processes a headless run is decomposed over
+int check_decomposition = 0; // Identifier for if a headless run is checked against a single process
+
+// Quantised copy of the state the interaction passes read of their neighbours. Positions are
+// 16-bit fixed point across the box and headings are octahedral-encoded, 10 bytes a fish
+// against the 48 of struct fish, decoded on the fly as the kernels walk the neighbours.
+struct packed_fish {
+    uint16_t position_q[3]; // Position as a fraction of the box width, 0 to 65535
+    int16_t heading_q[2]; // Heading folded onto the octahedron, -32767 to 32767
+};
+
+struct packed_fish *packed1; // Packed copy of species one
+struct packed_fish *packed2; // Packed copy of species two
+GLfloat packed_step; // Box units per position step of the packed copy
+int compact_state = 0; // Identifier for if the interaction passes read neighbours from the packed copy
+int compact_report = 0; // Identifier for if a headless run compares the packed path against full precision
+long long neighbour_reads = 0; // Neighbours the interaction passes have read, for the bandwidth report
+
+#ifndef _WIN32
+// A fish handed between the processes of a decomposed run. slot, the fish's index when the run
+// was decomposed, orders every process's fish the way the single process iterates them, so the
+// passes add up the same terms in the same order and the result is bit-identical.
+struct rank_fish {
+    struct fish fish;
+    int species; // 0 for species one, 1 for species two
+    int slot;
+};
+
+// Header of the memory shared by the processes of a decomposed run
+struct rank_shared {
+    pthread_barrier_t barrier;
+    int halo_count[MAX_RANKS]; // Fish each process published for its neighbours this step
+    int migrant_count[MAX_RANKS]; // Fish each process handed over this step
+    int halo_capacity[MAX_RANKS]; // Fish the halo list of each process holds
+    int migrant_capacity[MAX_RANKS]; // Fish the migrant list of each process holds
+};
+
+// A list of fish one process of a decomposed run publishes to the others. Each list is a shared
+// memory object of its own that only its owner grows, so it is sized to what that process
+// publishes rather than to the whole population.
+struct rank_channel {
+    int fd; // Shared memory object holding the list
+    struct rank_fish *fish; // This process's mapping of the list
+    int mapped; // Fish the mapping covers
+};
+
+// Fish owned by one process of a decomposed run, and the views its passes run over.
+// The arrays grow with the fish the process owns and sees.
+struct rank_state {
+    int rank;
+    GLfloat lower, upper; // x range of the slab the process owns
+    struct fish *own[2]; // owned fish of each species, ordered by slot
+    int *own_slot[2];
+    int own_count[2];
+    int own_capacity[2];
+    struct fish *view[2]; // owned and ghost fish of each species, ordered by slot
+    int view_count[2];
+    int *view_own[2]; // position of each owned fish in the view
+    int view_capacity[2];
+    struct rank_fish *incoming; // fish received from the other processes
+    int incoming_capacity;
+};
+
+GLfloat slab_width; // Width along x of the slab each process owns
+int halo_width; // Distance from a slab face within which fish are published to the neighbours
+struct rank_shared *rank_shared; // Shared header
+struct rank_channel rank_halos[MAX_RANKS]; // Fish each process publishes for its neighbours
+struct rank_channel rank_migrants[MAX_RANKS]; // Fish each process hands over
+struct fish *rank_results; // Final state by slot, species one then species two
+#endif
+
+// Phases of a simulation step that timings and hardware counters are attributed to
+enum phase { PHASE_MOVE, PHASE_ZOR, PHASE_OBSTACLES, PHASE_ZOO_ZOA, PHASE_SCHOOLS, PHASE_RENDER, PHASE_COUNT };
+const char *phase_names[PHASE_COUNT] = { "move", "ZOR", "obstacles", "ZOO/ZOA", "schools", "render" };
+
+// Hardware counters sampled through perf_event_open
+enum counter { COUNTER_CYCLES, COUNTER_INSTRUCTIONS, COUNTER_L1D_MISSES, COUNTER_LLC_MISSES, COUNTER_BRANCH_MISSES, COUNTER_COUNT };
+const char *counter_names[COUNTER_COUNT] = { "cycles", "instr", "L1D miss", "LLC miss", "br miss" };
+
+struct phase_stats {
+    double seconds; // wall-clock time spent in the phase
+    double counters[COUNTER_COUNT]; // hardware counter deltas, scaled for multiplexing
+    int calls; // number of times the phase was entered
+};
+
+struct phase_stats phase_totals[PHASE_COUNT]; // Accumulated since the last report
+double phase_start_time[PHASE_COUNT]; // Wall-clock time at which each phase was entered
+double phase_start_counters[PHASE_COUNT][COUNTER_COUNT]; // Counter values at which each phase was entered
+
+int show_stats = 0; // Identifier for if step statistics are printed to stdout
+int use_perf = 0; // Identifier for if hardware counters were requested
+int perf_group_fd = -1; // Group leader of the opened counters, -1 when counters are unavailable
+int perf_slot_counter[COUNTER_COUNT]; // Which counter each value of a group read belongs to
+int perf_slots = 0; // Number of counters opened in the group
+int stats_interval = 100; // Number of steps between statistics reports
+int stats_steps = 0; // Steps accumulated since the last report
+GLdouble last_step_ms = 0.0; // Mean step time of the last report, shown on the HUD
+unsigned long sim_tick = 0; // Number of steps simulated since the last restart
+
+GLdouble target_tps = 60.0; // Simulation steps per second, 0 steps as fast as possible
+GLdouble target_fps = 60.0; // Frames drawn per second
+double next_step_time, next_frame_time; // Deadlines of the next step and frame
+double rate_window_start; // Start of the window the measured rates are counted over
+int window_steps, window_frames; // Steps and frames in the current window
+GLdouble measured_tps, measured_fps; // Rates measured over the last window, shown on the HUD
+
+unsigned long long seed = 1; // Seed of the random number generator
+unsigned int restart_count = 0; // Number of restarts, so each restart draws a new population
+
+// Random streams, so draws made for different purposes never share a counter
+enum rng_stream { RNG_INIT_SPEC1, RNG_INIT_SPEC2, RNG_TURN_FALLBACK_SPEC1, RNG_TURN_FALLBACK_SPEC2,
+    RNG_INIT_PREDATOR, RNG_TURN_FALLBACK_PREDATOR, RNG_DESPAWN_SPEC1, RNG_DESPAWN_SPEC2 };
+
                  // Calculates the length of the given vector
 GLfloat calculate_magnitude(GLfloat *vector) {
     return(fabs(sqrt(vector[0] * vector[0] + vector[1] * vector[1] + vector[2] * vector[2])));
@@ -134,6 +355,13 @@ GLfloat calculate_distance(GLfloat *vec_a, GLfloat *vec_b) {
     return calculate_magnitude(dir_vec);
 }
 
+// Checks if two positions are closer than range along every axis, a cheap test that fails for
+// every pair further apart than range. The axes are combined without branching.
+int within_axis_range(GLfloat *vec_a, GLfloat *vec_b, GLfloat range) {
+    return (fabs(vec_a[0] - vec_b[0]) < range) & (fabs(vec_a[1] - vec_b[1]) < range) &
+        (fabs(vec_a[2] - vec_b[2]) < range);
+}
+
 // Rodrigues' rotation formula
 // Rotates a vector around an axis
 void rotate_vector(GLfloat *axis_v, GLfloat *dir_v, GLdouble radian) {
@@ -146,16 +374,240 @@ void rotate_vector(GLfloat *axis_v, GLfloat *dir_v, GLdouble radian) {
     }
 }
 
-//Return random GLfloat within range [-box_edge_size,box_edge_size]
-GLfloat generate_box_value() {
-    return (((rand() / (double)RAND_MAX)) - 0.5) * box_edge_size * 2.0;
+// Returns a monotonic wall-clock time in seconds
+double get_time_seconds(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, count;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+// Sleeps until the given get_time_seconds() deadline
+void sleep_until(double deadline) {
+#ifdef _WIN32
+    // Sleep() is only as fine as the system tick, so sleep short and spin the remainder
+    double remaining = deadline - get_time_seconds();
+    if (remaining > 0.002)
+        Sleep((DWORD)((remaining - 0.002) * 1000.0));
+    while (get_time_seconds() < deadline)
+        SwitchToThread();
+#else
+    struct timespec ts;
+    if (deadline <= get_time_seconds())
+        return;
+    ts.tv_sec = (time_t)deadline;
+    ts.tv_nsec = (long)((deadline - (double)ts.tv_sec) * 1e9);
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+#endif
+}
+
+#ifdef __linux__
+// Opens one hardware counter, joining the group led by group_fd (-1 to start a new group)
+int open_perf_counter(int counter, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    switch (counter) {
+    case COUNTER_CYCLES:
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+    case COUNTER_INSTRUCTIONS:
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+    case COUNTER_L1D_MISSES:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+    case COUNTER_LLC_MISSES:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+    case COUNTER_BRANCH_MISSES:
+        attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+        break;
+    }
+    attr.disabled = (group_fd == -1);
+    attr.exclude_kernel = 1; // Lets the counters open under perf_event_paranoid = 2
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+#endif
+
+// Opens the hardware counters as one group. Counters the machine or container does not
+// provide are skipped, and if none can be opened only wall-clock timings are reported.
+void open_perf_counters(void) {
+#ifdef __linux__
+    int i, fd;
+    for (i = 0; i < COUNTER_COUNT; i++) {
+        fd = open_perf_counter(i, perf_group_fd);
+        if (fd == -1) {
+            fprintf(stderr, "perf: %s counter unavailable (%s)\n", counter_names[i], strerror(errno));
+            continue;
+        }
+        if (perf_group_fd == -1)
+            perf_group_fd = fd;
+        perf_slot_counter[perf_slots++] = i;
+    }
+    if (perf_group_fd == -1) {
+        fprintf(stderr, "perf: no hardware counters available, reporting wall-clock timings only\n");
+        return;
+    }
+    ioctl(perf_group_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(perf_group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#else
+    fprintf(stderr, "perf: hardware counters are only supported on Linux, reporting wall-clock timings only\n");
+#endif
+}
+
+// Reads the current counter values into values, scaled up if the group was multiplexed
+void read_perf_counters(double *values) {
+    int i;
+    for (i = 0; i < COUNTER_COUNT; i++)
+        values[i] = 0.0;
+#ifdef __linux__
+    // Layout of a PERF_FORMAT_GROUP read: nr, time_enabled, time_running, values[nr]
+    unsigned long long buffer[3 + COUNTER_COUNT];
+    double scale = 1.0;
+    if (perf_group_fd == -1)
+        return;
+    if (read(perf_group_fd, buffer, sizeof(buffer)) < (ssize_t)(3 * sizeof(buffer[0])))
+        return;
+    if (buffer[2] > 0 && buffer[2] < buffer[1])
+        scale = (double)buffer[1] / (double)buffer[2];
+    for (i = 0; i < perf_slots && i < (int)buffer[0]; i++)
+        values[perf_slot_counter[i]] = buffer[3 + i] * scale;
+#endif
+}
+
+// Marks the start of a phase
+void phase_begin(int phase) {
+    if (perf_group_fd != -1)
+        read_perf_counters(phase_start_counters[phase]);
+    phase_start_time[phase] = get_time_seconds();
+}
+
+// Marks the end of a phase and attributes the elapsed time and counter deltas to it
+void phase_end(int phase) {
+    int i;
+    double values[COUNTER_COUNT];
+    phase_totals[phase].seconds += get_time_seconds() - phase_start_time[phase];
+    phase_totals[phase].calls++;
+    if (perf_group_fd != -1) {
+        read_perf_counters(values);
+        for (i = 0; i < COUNTER_COUNT; i++)
+            phase_totals[phase].counters[i] += values[i] - phase_start_counters[phase][i];
+    }
+}
+
+// Returns 1 if the given counter was opened
+int perf_counter_open(int counter) {
+    int i;
+    for (i = 0; i < perf_slots; i++) {
+        if (perf_slot_counter[i] == counter)
+            return 1;
+    }
+    return 0;
+}
+
+// Prints the per-phase statistics accumulated since the last report and resets them.
+// Phase times and counters are given per call, so render is per frame and the rest per step.
+void report_stats(unsigned long tick) {
+    int i, j;
+    GLdouble step_seconds = 0.0;
+    for (i = 0; i < PHASE_COUNT; i++) {
+        if (i != PHASE_RENDER)
+            step_seconds += phase_totals[i].seconds;
+    }
+    last_step_ms = stats_steps ? step_seconds * 1000.0 / stats_steps : 0.0;
+
+    if (show_stats) {
+        printf("step %lu: %.3f ms/step over %d steps\n", tick, last_step_ms, stats_steps);
+        for (i = 0; i < PHASE_COUNT; i++) {
+            struct phase_stats *s = &phase_totals[i];
+            if (s->calls == 0)
+                continue;
+            printf("  %-9s %9.3f ms", phase_names[i], s->seconds * 1000.0 / s->calls);
+            if (perf_group_fd != -1) {
+                for (j = 0; j < COUNTER_COUNT; j++) {
+                    if (perf_counter_open(j))
+                        printf("  %s %.3g", counter_names[j], s->counters[j] / s->calls);
+                    else
+                        printf("  %s -", counter_names[j]);
+                }
+                if (perf_counter_open(COUNTER_CYCLES) && perf_counter_open(COUNTER_INSTRUCTIONS) &&
+                    s->counters[COUNTER_CYCLES] > 0.0)
+                    printf("  IPC %.2f", s->counters[COUNTER_INSTRUCTIONS] / s->counters[COUNTER_CYCLES]);
+            }
+            printf("\n");
+        }
+        fflush(stdout);
+    }
+    memset(phase_totals, 0, sizeof(phase_totals));
+    stats_steps = 0;
+}
+
+// Philox4x32-10 counter-based generator (Salmon et al., 2011).
+// The output is a pure function of counter and key, so any thread can draw without shared state.
+void philox4x32(const uint32_t *counter, const uint32_t *key, uint32_t *out) {
+    int round;
+    uint32_t c[4], k[2];
+    uint64_t p0, p1;
+    memcpy(c, counter, sizeof(c));
+    memcpy(k, key, sizeof(k));
+    for (round = 0; round < 10; round++) {
+        if (round > 0) {
+            k[0] += 0x9E3779B9;
+            k[1] += 0xBB67AE85;
+        }
+        p0 = (uint64_t)0xD2511F53 * c[0];
+        p1 = (uint64_t)0xCD9E8D57 * c[2];
+        c[0] = (uint32_t)(p1 >> 32) ^ c[1] ^ k[0];
+        c[1] = (uint32_t)p1;
+        c[2] = (uint32_t)(p0 >> 32) ^ c[3] ^ k[1];
+        c[3] = (uint32_t)p0;
+    }
+    memcpy(out, c, sizeof(c));
+}
+
+// Fills out with four random words keyed on the seed, the fish id and the current tick.
+// draw distinguishes several draws made for the same fish within one tick.
+void generate_random_block(unsigned int stream, unsigned int id, unsigned int draw, uint32_t *out) {
+    uint32_t counter[4], key[2];
+    counter[0] = id;
+    counter[1] = (uint32_t)sim_tick;
+    counter[2] = (stream << 24) ^ draw;
+    counter[3] = restart_count;
+    key[0] = (uint32_t)seed;
+    key[1] = (uint32_t)(seed >> 32);
+    philox4x32(counter, key, out);
 }
 
-// Generates a random vector
-void generate_vector(GLfloat *vector) {
-    vector[0] = generate_box_value();
-    vector[1] = generate_box_value();
-    vector[2] = generate_box_value();
+//Return GLfloat within range [-box_edge_size,box_edge_size] for a random word
+GLfloat generate_box_value(uint32_t word) {
+    return ((word * (1.0 / 4294967296.0)) - 0.5) * box_edge_size * 2.0;
+}
+
+// Generates a random vector for the given fish
+void generate_vector(GLfloat *vector, unsigned int stream, unsigned int id, unsigned int draw) {
+    uint32_t words[4];
+    generate_random_block(stream, id, draw, words);
+    vector[0] = generate_box_value(words[0]);
+    vector[1] = generate_box_value(words[1]);
+    vector[2] = generate_box_value(words[2]);
 }
 
 // Maps a position vector to RGB values    
@@ -166,6 +618,74 @@ void calculate_rgb(GLfloat *position, GLfloat *rgb) {
     }
 }
 
+// Maps a school label to a distinct RGB colour, grey for fish outside a school
+void calculate_school_rgb(int label, GLfloat *rgb) {
+    GLdouble hue, f;
+    int sector;
+    if (label == SCHOOL_NONE) {
+        rgb[0] = rgb[1] = rgb[2] = 0.6;
+        return;
+    }
+    // Golden ratio steps keep consecutive labels far apart in hue
+    hue = fmod(label * 0.618033988749895, 1.0) * 6.0;
+    sector = (int)hue;
+    f = hue - sector;
+    switch (sector) {
+    case 0: rgb[0] = 0.9; rgb[1] = 0.9 * f; rgb[2] = 0.1; break;
+    case 1: rgb[0] = 0.9 * (1.0 - f); rgb[1] = 0.9; rgb[2] = 0.1; break;
+    case 2: rgb[0] = 0.1; rgb[1] = 0.9; rgb[2] = 0.9 * f; break;
+    case 3: rgb[0] = 0.1; rgb[1] = 0.9 * (1.0 - f); rgb[2] = 0.9; break;
+    case 4: rgb[0] = 0.9 * f; rgb[1] = 0.1; rgb[2] = 0.9; break;
+    default: rgb[0] = 0.9; rgb[1] = 0.1; rgb[2] = 0.9 * (1.0 - f); break;
+    }
+}
+
+// Draws the obstacles and predators
+void draw_obstacles(void) {
+    int i, j;
+    GLfloat normal_v[3], edge1[3], edge2[3];
+    struct obstacle *o;
+
+    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, obstacle_colour);
+    for (i = 0; i < obstacle_count; i++) {
+        o = &obstacles[i];
+        if (o->type == OBSTACLE_SPHERE) {
+            glPushMatrix();
+            glTranslatef(o->v[0][0], o->v[0][1], o->v[0][2]);
+            glutSolidSphere(o->v[1][0], 16, 16);
+            glPopMatrix();
+        }
+        else if (o->type == OBSTACLE_BOX) {
+            glPushMatrix();
+            glTranslatef((o->v[0][0] + o->v[1][0]) * 0.5, (o->v[0][1] + o->v[1][1]) * 0.5, (o->v[0][2] + o->v[1][2]) * 0.5);
+            glScalef(o->v[1][0] - o->v[0][0], o->v[1][1] - o->v[0][1], o->v[1][2] - o->v[0][2]);
+            glutSolidCube(1.0);
+            glPopMatrix();
+        }
+    }
+    glBegin(GL_TRIANGLES);
+    for (i = 0; i < obstacle_count; i++) {
+        o = &obstacles[i];
+        if (o->type != OBSTACLE_TRIANGLE)
+            continue;
+        calculate_direction_vector(o->v[0], o->v[1], edge1);
+        calculate_direction_vector(o->v[0], o->v[2], edge2);
+        calculate_cross_prod(edge1, edge2, normal_v);
+        glNormal3fv(normal_v);
+        for (j = 0; j < 3; j++)
+            glVertex3fv(o->v[j]);
+    }
+    glEnd();
+
+    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, predator_colour);
+    for (i = 0; i < predator_count; i++) {
+        glPushMatrix();
+        glTranslatef(predators[i].position_v[0], predators[i].position_v[1], predators[i].position_v[2]);
+        glutSolidSphere(1.2, 20, 20);
+        glPopMatrix();
+    }
+}
+
 // Draws all of the objects in the scene
 void draw_scene(void) {
     int x, z, y;
@@ -174,7 +694,11 @@ void draw_scene(void) {
 
     int i;
     for (i = 0; i < fish1_count; i++) {
-        if (!two_species) {
+        if (colour_schools) {
+            calculate_school_rgb(f1[i].school, matSurface);
+            glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, matSurface);
+        }
+        else if (!two_species) {
             calculate_rgb(f1[i].position_v, matSurface);
             glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, matSurface);
         }
@@ -189,6 +713,10 @@ void draw_scene(void) {
     if (two_species) {
         glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, species2_colour);
         for (i = 0; i < fish2_count; i++) {
+            if (colour_schools) {
+                calculate_school_rgb(f2[i].school, matSurface);
+                glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, matSurface);
+            }
             glPushMatrix();
             glTranslatef(f2[i].position_v[0], f2[i].position_v[1], f2[i].position_v[2]);
             glutSolidSphere(0.5, 20, 20);
@@ -196,6 +724,8 @@ void draw_scene(void) {
         }
     }
 
+    draw_obstacles();
+
     glMaterialfv(GL_FRONT, GL_DIFFUSE, matSurface2);
 
     glDepthRange(0.1, 1.0);
@@ -371,7 +901,52 @@ void draw_HUD() {
         snprintf(string, 11 + return_digits(ZOA_range_spec2[1]), "ZOA(2-2): %d", ZOA_range_spec2[1]);
         print_text(string, font, 10, y_pos -= 15);
     }
-    y_pos = 330;
+    y_pos = height - 20;
+
+    snprintf(string, sizeof(string), "Step: %.3f ms", last_step_ms);
+    print_text(string, font, width - 200, y_pos -= 15);
+
+    snprintf(string, sizeof(string), "Steps/s: %.0f", measured_tps);
+    print_text(string, font, width - 200, y_pos -= 15);
+
+    snprintf(string, sizeof(string), "Frames/s: %.0f", measured_fps);
+    print_text(string, font, width - 200, y_pos -= 15);
+
+    snprintf(string, sizeof(string), "Polar(1): %.3f", order_spec1.polarisation);
+    print_text(string, font, width - 200, y_pos -= 15);
+
+    snprintf(string, sizeof(string), "Mill(1): %.3f", order_spec1.milling);
+    print_text(string, font, width - 200, y_pos -= 15);
+
+    snprintf(string, sizeof(string), "Spread(1): %.1f", order_spec1.dispersion);
+    print_text(string, font, width - 200, y_pos -= 15);
+
+    if (two_species) {
+        snprintf(string, sizeof(string), "Polar(2): %.3f", order_spec2.polarisation);
+        print_text(string, font, width - 200, y_pos -= 15);
+
+        snprintf(string, sizeof(string), "Mill(2): %.3f", order_spec2.milling);
+        print_text(string, font, width - 200, y_pos -= 15);
+
+        snprintf(string, sizeof(string), "Spread(2): %.1f", order_spec2.dispersion);
+        print_text(string, font, width - 200, y_pos -= 15);
+    }
+
+    if (school_tracking) {
+        snprintf(string, sizeof(string), "Schools: %d", school_count);
+        print_text(string, font, width - 200, y_pos -= 15);
+
+        snprintf(string, sizeof(string), "Largest: %d", largest_school);
+        print_text(string, font, width - 200, y_pos -= 15);
+
+        snprintf(string, sizeof(string), "Merges: %d", school_merges);
+        print_text(string, font, width - 200, y_pos -= 15);
+
+        snprintf(string, sizeof(string), "Splits: %d", school_splits);
+        print_text(string, font, width - 200, y_pos -= 15);
+    }
+
+    y_pos = 360;
 
     print_text("Controls -", font, 5, y_pos -= 15);
 
@@ -396,6 +971,8 @@ void draw_HUD() {
     print_text("Toggle walls: 'a'", font, 10, y_pos -= 15);
     print_text("Toggle species: 'z'", font, 10, y_pos -= 15);
     print_text("Pause: 'p'", font, 10, y_pos -= 15);
+    print_text("Sim rate: '-,+'", font, 10, y_pos -= 15);
+    print_text("Colour schools: 'g'", font, 10, y_pos -= 15);
 
     glMatrixMode(GL_PROJECTION);
     glPopMatrix();
@@ -417,8 +994,11 @@ void display(void) {
     gluLookAt(eyex, eyey, eyez, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0);
 
     glLightfv(GL_LIGHT0, GL_POSITION, light_position0);
+    phase_begin(PHASE_RENDER);
     draw_scene();
+    phase_end(PHASE_RENDER);
     glutSwapBuffers();
+    window_frames++;
 }
 
 // Sets all the dimensions of a vector to zero
@@ -434,12 +1014,51 @@ int is_zero_vector(GLfloat *vector) {
     return 0;
 }
 
+// Derives the order metrics from sums taken in a single pass over the fish.
+// The angular momentum about the centroid c is sum((p - c) x d) = sum(p x d) - c x sum(d), so it
+// needs no second pass once c is known. It is divided by count times the rms distance from c,
+// which bounds it by 1 and reaches 1 when every fish circles c at the same radius.
+void finish_order_metrics(struct order_metrics *metrics, int count, GLdouble *sum_dir, GLdouble *sum_pos,
+    GLdouble *sum_moment, GLdouble sum_pos_sq) {
+    int j;
+    GLdouble moment[3], spread;
+
+    memset(metrics, 0, sizeof(*metrics));
+    metrics->count = count;
+    if (count == 0)
+        return;
+    for (j = 0; j < 3; j++)
+        metrics->centroid[j] = sum_pos[j] / count;
+    metrics->polarisation = sqrt(sum_dir[0] * sum_dir[0] + sum_dir[1] * sum_dir[1] + sum_dir[2] * sum_dir[2]) / count;
+    spread = sum_pos_sq / count - (metrics->centroid[0] * metrics->centroid[0] +
+        metrics->centroid[1] * metrics->centroid[1] + metrics->centroid[2] * metrics->centroid[2]);
+    metrics->dispersion = spread > 0.0 ? sqrt(spread) : 0.0;
+    moment[0] = sum_moment[0] - (metrics->centroid[1] * sum_dir[2] - metrics->centroid[2] * sum_dir[1]);
+    moment[1] = sum_moment[1] - (metrics->centroid[2] * sum_dir[0] - metrics->centroid[0] * sum_dir[2]);
+    moment[2] = sum_moment[2] - (metrics->centroid[0] * sum_dir[1] - metrics->centroid[1] * sum_dir[0]);
+    if (metrics->dispersion > 0.0)
+        metrics->milling = sqrt(moment[0] * moment[0] + moment[1] * moment[1] + moment[2] * moment[2]) /
+            (count * metrics->dispersion);
+}
+
+// Appends the order metrics of a species to the time series file
+void write_order_metrics(int species, struct order_metrics *metrics) {
+    fprintf(metrics_file, "%lu,%d,%d,%.6f,%.6f,%.4f,%.4f,%.4f,%.4f\n", sim_tick, species, metrics->count,
+        metrics->polarisation, metrics->milling, metrics->centroid[0], metrics->centroid[1], metrics->centroid[2],
+        metrics->dispersion);
+}
+
 // Rotates the direction vector closer to it's next direction vector, alters the position vector
 // and manages wall collision
-void move_fish(struct fish *f, int fish_count, GLdouble radian) {
+// Also accumulates the sums that the order metrics of the moved fish are derived from.
+void move_fish(struct fish *f, int fish_count, GLdouble radian, unsigned int stream, struct order_metrics *metrics) {
     int i, j;
+    unsigned int draw;
     GLfloat normal_v[3], safety_v[3];
-
+    GLdouble sum_dir[3] = { 0.0, 0.0, 0.0 }; // Sum of the headings
+    GLdouble sum_pos[3] = { 0.0, 0.0, 0.0 }; // Sum of the positions
+    GLdouble sum_moment[3] = { 0.0, 0.0, 0.0 }; // Sum of position x heading about the origin
+    GLdouble sum_pos_sq = 0.0; // Sum of the squared distances from the origin
 
     for (i = 0; i < fish_count; i++) {
         if (!(is_zero_vector(f[i].next_direction_v))) {
@@ -457,8 +1076,9 @@ void move_fish(struct fish *f, int fish_count, GLdouble radian) {
                     rotate_vector(normal_v, f[i].direction_v, radian);
                 }
                 else {
+                    draw = 0;
                     do {
-                        generate_vector(safety_v);
+                        generate_vector(safety_v, stream, f[i].id, draw++);
                         normalise_vector(safety_v);
                     } while (f[i].direction_v[0] == safety_v[0] && f[i].direction_v[1] == safety_v[1] && f[i].direction_v[1] == safety_v[1]);
                     calculate_cross_prod(f[i].direction_v, safety_v, normal_v);
@@ -477,21 +1097,228 @@ void move_fish(struct fish *f, int fish_count, GLdouble radian) {
             }
         }
 
+        for (j = 0; j < 3; j++) {
+            sum_dir[j] += f[i].direction_v[j];
+            sum_pos[j] += f[i].position_v[j];
+            sum_pos_sq += f[i].position_v[j] * f[i].position_v[j];
+        }
+        sum_moment[0] += f[i].position_v[1] * f[i].direction_v[2] - f[i].position_v[2] * f[i].direction_v[1];
+        sum_moment[1] += f[i].position_v[2] * f[i].direction_v[0] - f[i].position_v[0] * f[i].direction_v[2];
+        sum_moment[2] += f[i].position_v[0] * f[i].direction_v[1] - f[i].position_v[1] * f[i].direction_v[0];
+    }
+    finish_order_metrics(metrics, fish_count, sum_dir, sum_pos, sum_moment, sum_pos_sq);
+}
+
+// Returns the union-find node of a fish: species one first, then species two
+int school_node(struct fish *f) {
+    if (f >= f1 && f < f1 + fish1_count)
+        return (int)(f - f1);
+    return fish1_count + (int)(f - f2);
+}
+
+// Returns the fish behind a union-find node
+struct fish *school_fish(int node) {
+    return node < fish1_count ? &f1[node] : &f2[node - fish1_count];
+}
+
+// Finds the root of a node's set, halving the path on the way
+int school_find(int node) {
+    while (school_parent[node] != node) {
+        school_parent[node] = school_parent[school_parent[node]];
+        node = school_parent[node];
+    }
+    return node;
+}
+
+// Records that two fish interact, joining their schools
+void school_link(struct fish *a, struct fish *b) {
+    int root_a = school_find(school_node(a));
+    int root_b = school_find(school_node(b));
+    if (root_a == root_b)
+        return;
+    if (school_size[root_a] < school_size[root_b]) {
+        school_parent[root_a] = root_b;
+        school_size[root_b] += school_size[root_a];
+    }
+    else {
+        school_parent[root_b] = root_a;
+        school_size[root_a] += school_size[root_b];
+    }
+}
+
+// Allocates the school detection arrays for the given number of fish.
+// Labels are kept below capacity, which always leaves a free one as schools have two or more fish.
+// The new arrays are allocated before the old ones are freed, so when memory runs out this
+// returns 0 and the old arrays are left as they were.
+int allocate_schools(int capacity) {
+    int i, n;
+    int **arrays[] = { &school_parent, &school_size, &school_fill, &school_members, &school_label_count,
+        &school_label_owner, &school_best_label, &school_best_count, &school_root_label, &school_start };
+    int *allocated[sizeof(arrays) / sizeof(arrays[0])];
+
+    n = (int)(sizeof(arrays) / sizeof(arrays[0]));
+    for (i = 0; i < n; i++) {
+        // One more than capacity, for school_start's end offset and so no size is zero
+        allocated[i] = (int*)malloc(sizeof(int) * ((size_t)capacity + 1));
+        if (allocated[i] == NULL) {
+            while (i > 0)
+                free(allocated[--i]);
+            return 0;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        free(*arrays[i]);
+        *arrays[i] = allocated[i];
+    }
+    for (i = 0; i < capacity; i++) {
+        school_label_count[i] = 0;
+        school_label_owner[i] = SCHOOL_NONE;
+    }
+    school_capacity = capacity;
+    school_next_label = 0;
+    return 1;
+}
+
+// Starts a step of school detection with every fish in a school of its own
+void begin_schools(void) {
+    int i;
+    school_nodes = fish1_count + (two_species ? fish2_count : 0);
+    for (i = 0; i < school_nodes; i++) {
+        school_parent[i] = i;
+        school_size[i] = 1;
+    }
+}
+
+// Labels the schools linked during this step. Each school proposes the label most of its fish had
+// on the previous step; when several propose the same label the one holding most of those fish
+// keeps it and the others split off under fresh labels. A previous label no school kept, with two
+// or more of its fish in a school that kept another label, has merged. Lone fish are not a school.
+void finish_schools(void) {
+    int i, k, root, label, count, best, best_count, first, last;
+
+    // Bucket the fish by the root of their set
+    for (i = 0; i <= school_nodes; i++)
+        school_start[i] = 0;
+    for (i = 0; i < school_nodes; i++) {
+        school_parent[i] = school_find(i);
+        school_start[school_parent[i] + 1]++;
+        school_fill[i] = 0;
+    }
+    for (i = 0; i < school_nodes; i++)
+        school_start[i + 1] += school_start[i];
+    for (i = 0; i < school_nodes; i++) {
+        root = school_parent[i];
+        school_members[school_start[root] + school_fill[root]++] = i;
+    }
+
+    // Each school proposes the previous label most of its fish had
+    for (root = 0; root < school_nodes; root++) {
+        if (school_parent[root] != root || school_size[root] < 2)
+            continue;
+        first = school_start[root];
+        last = first + school_size[root];
+        best = SCHOOL_NONE;
+        best_count = 0;
+        for (k = first; k < last; k++) {
+            label = school_fish(school_members[k])->school;
+            if (label == SCHOOL_NONE)
+                continue;
+            count = ++school_label_count[label];
+            if (count > best_count || (count == best_count && label < best)) {
+                best = label;
+                best_count = count;
+            }
+        }
+        for (k = first; k < last; k++) {
+            label = school_fish(school_members[k])->school;
+            if (label != SCHOOL_NONE)
+                school_label_count[label] = 0;
+        }
+        school_best_label[root] = best;
+        school_best_count[root] = best_count;
+        if (best != SCHOOL_NONE) {
+            i = school_label_owner[best];
+            if (i == SCHOOL_NONE || best_count > school_best_count[i] ||
+                (best_count == school_best_count[i] && school_size[root] > school_size[i]))
+                school_label_owner[best] = root;
+        }
+    }
+
+    // Count the previous labels absorbed into a school that kept another label
+    for (root = 0; root < school_nodes; root++) {
+        if (school_parent[root] != root || school_size[root] < 2 || school_best_label[root] == SCHOOL_NONE ||
+            school_label_owner[school_best_label[root]] != root)
+            continue;
+        first = school_start[root];
+        last = first + school_size[root];
+        for (k = first; k < last; k++) {
+            label = school_fish(school_members[k])->school;
+            if (label != SCHOOL_NONE && school_label_owner[label] == SCHOOL_NONE &&
+                ++school_label_count[label] == 2) {
+                school_label_owner[label] = SCHOOL_MERGED;
+                school_merges++;
+            }
+        }
+        for (k = first; k < last; k++) {
+            label = school_fish(school_members[k])->school;
+            if (label != SCHOOL_NONE)
+                school_label_count[label] = 0;
+        }
+    }
+
+    // Keep the winning labels and hand out fresh ones to the rest
+    school_count = 0;
+    largest_school = 0;
+    for (root = 0; root < school_nodes; root++) {
+        if (school_parent[root] != root || school_size[root] < 2)
+            continue;
+        best = school_best_label[root];
+        if (best != SCHOOL_NONE && school_label_owner[best] == root) {
+            school_root_label[root] = best;
+        }
+        else {
+            if (best != SCHOOL_NONE && school_best_count[root] >= 2)
+                school_splits++;
+            while (school_label_owner[school_next_label] != SCHOOL_NONE)
+                school_next_label = (school_next_label + 1) % school_capacity;
+            school_root_label[root] = school_next_label;
+            school_label_owner[school_next_label] = root;
+        }
+        school_count++;
+        if (school_size[root] > largest_school)
+            largest_school = school_size[root];
+    }
+
+    // Write the labels back, clearing the ownership marks of both the old and the new labels
+    for (i = 0; i < school_nodes; i++) {
+        struct fish *f = school_fish(i);
+        root = school_parent[i];
+        if (f->school != SCHOOL_NONE)
+            school_label_owner[f->school] = SCHOOL_NONE;
+        f->school = school_size[root] >= 2 ? school_root_label[root] : SCHOOL_NONE;
+        if (f->school != SCHOOL_NONE)
+            school_label_owner[f->school] = SCHOOL_NONE;
     }
 }
 
 // Determines the next direction vector with regards to the zone of repulsion
+// Repulsion only links fish of the same species into a school.
+// Fish further than zor along an axis are passed over before the distance and angle are worked out.
 void update_in_ZOR(struct fish *fish1, struct fish *fish2, int fish_count, int zor) {
     int i;
     GLfloat vector[3];
+    int same_species = fish1 >= fish2 && fish1 < fish2 + fish_count;
 
+    neighbour_reads += fish_count;
     for (i = 0; i < fish_count; i++) {
-        if (fish1 != &fish2[i]) {
+        if (fish1 != &fish2[i] && within_axis_range(fish1->position_v, fish2[i].position_v, zor)) {
             calculate_direction_vector(fish1->position_v, fish2[i].position_v, vector);
             if (calculate_distance(fish1->position_v, fish2[i].position_v) < zor &&
                 calculate_angle(fish1->direction_v, vector) < blind_radian_segment) {
-                fish1->in_ZOR = 1;
+                fish1->zones |= ZONE_ZOR;
                 update_direction_vector(fish2[i].position_v, fish1->position_v, fish1->next_direction_v);
+                if (school_tracking && same_species)
+                    school_link(fish1, &fish2[i]);
             }
         }
     }
@@ -499,181 +1326,1013 @@ void update_in_ZOR(struct fish *fish1, struct fish *fish2, int fish_count, int z
 
 // Determines the next direction vector with regards to the zone of orientation 
 // and zone of attraction
+// Fish further than the wider of the two zones along an axis are passed over up front.
 void update_in_ZOO_ZOA(struct fish *fish1, struct fish *fish2, int fish_count, int zoo, int zoa) {
     int i, j;
     GLfloat dist;
     GLfloat vector[3];
+    int range = zoo > zoa ? zoo : zoa;
 
+    neighbour_reads += fish_count;
     for (i = 0; i < fish_count; i++) {
-        if (fish1 != &fish2[i]) {
+        if (fish1 != &fish2[i] && within_axis_range(fish1->position_v, fish2[i].position_v, range)) {
             calculate_direction_vector(fish1->position_v, fish2[i].position_v, vector);
             if (calculate_angle(fish1->direction_v, vector) < blind_radian_segment) {
                 dist = calculate_distance(fish1->position_v, fish2[i].position_v);
                 if (dist < zoo) {
-                    fish1->in_ZOO = 1;
+                    fish1->zones |= ZONE_ZOO;
                     for (j = 0; j < 3; j++) {
                         fish1->next_direction_v[j] += fish2[i].direction_v[j];
                     }
+                    if (school_tracking)
+                        school_link(fish1, &fish2[i]);
                 }
                 else if (dist >= zoo && dist < zoa) {
-                    fish1->in_ZOA = 1;
+                    fish1->zones |= ZONE_ZOA;
                     update_direction_vector(fish1->position_v, fish2[i].position_v, fish1->next_direction_v);
+                    if (school_tracking)
+                        school_link(fish1, &fish2[i]);
                 }
             }
         }
     }
 }
 
+// Quantises one coordinate to a position step of the packed copy, rounding to the nearest step
+uint16_t pack_coordinate(GLfloat x) {
+    GLfloat q = (x + box_edge_size) / packed_step + 0.5;
+    if (q <= 0.0)
+        return 0;
+    if (q >= 65535.0)
+        return 65535;
+    return (uint16_t)q;
+}
 
-// Updates the positions and directions of the fish.
-void update_fish(void) {
+// Folds a unit heading onto the octahedron |x| + |y| + |z| = 1 and keeps x and y.
+// The lower half is unfolded over the diagonals so every heading has one code.
+void pack_heading(GLfloat *v, int16_t *q) {
+    GLfloat l1 = fabs(v[0]) + fabs(v[1]) + fabs(v[2]);
+    GLfloat x = v[0] / l1, y = v[1] / l1, t;
+    if (v[2] < 0.0) {
+        t = x;
+        x = (1.0 - fabs(y)) * (t < 0.0 ? -1.0 : 1.0);
+        y = (1.0 - fabs(t)) * (y < 0.0 ? -1.0 : 1.0);
+    }
+    q[0] = (int16_t)floor(x * 32767.0 + 0.5);
+    q[1] = (int16_t)floor(y * 32767.0 + 0.5);
+}
+
+// Decodes the position of a packed fish
+void unpack_position(struct packed_fish *p, GLfloat *v) {
+    int j;
+    for (j = 0; j < 3; j++)
+        v[j] = p->position_q[j] * packed_step - box_edge_size;
+}
+
+// Decodes the heading of a packed fish into a unit vector
+void unpack_heading(struct packed_fish *p, GLfloat *v) {
+    GLfloat t;
+    v[0] = p->heading_q[0] / 32767.0;
+    v[1] = p->heading_q[1] / 32767.0;
+    v[2] = 1.0 - fabs(v[0]) - fabs(v[1]);
+    if (v[2] < 0.0) {
+        t = v[0];
+        v[0] = (1.0 - fabs(v[1])) * (t < 0.0 ? -1.0 : 1.0);
+        v[1] = (1.0 - fabs(t)) * (v[1] < 0.0 ? -1.0 : 1.0);
+    }
+    normalise_vector(v);
+}
+
+// Refreshes the packed copy of f1 and f2 from the moved fish
+void pack_fish_state(void) {
     int i, j;
+    packed_step = 2.0 * box_edge_size / 65535.0;
+    for (i = 0; i < fish1_count; i++) {
+        for (j = 0; j < 3; j++)
+            packed1[i].position_q[j] = pack_coordinate(f1[i].position_v[j]);
+        pack_heading(f1[i].direction_v, packed1[i].heading_q);
+    }
+    for (i = 0; two_species && i < fish2_count; i++) {
+        for (j = 0; j < 3; j++)
+            packed2[i].position_q[j] = pack_coordinate(f2[i].position_v[j]);
+        pack_heading(f2[i].direction_v, packed2[i].heading_q);
+    }
+}
 
-    if (!pause) {
-        // Alter fish positions
-        move_fish(f1, fish1_count, turning_radian_spec1);
-        if (two_species) {
-            move_fish(f2, fish2_count, turning_radian_spec2);
-        }
-        // Alter next_direction vectors of species 1.
-        for (i = 0; i < fish1_count; i++) {
-            initialise_vector(f1[i].next_direction_v);
-            update_in_ZOR(&f1[i], f1, fish1_count, ZOR_range_spec1[0]);
-            if (two_species) {
-                update_in_ZOR(&f1[i], f2, fish2_count, ZOR_range_spec1[1]);
-            }
-            // Only do ZOO,ZOA work if no fish were in the ZOR
-            if (!(f1[i].in_ZOR)) {
-                update_in_ZOO_ZOA(&f1[i], f1, fish1_count, ZOO_range_spec1[0], ZOA_range_spec1[0]);
-                if (two_species) {
-                    update_in_ZOO_ZOA(&f1[i], f2, fish2_count, ZOO_range_spec1[1], ZOA_range_spec1[1]);
-                }
-            }
-        }
+// Finds the codes along each axis that lie within range of position, widened by a step either
+// side so rounding never drops a fish that is in range
+void packed_window(GLfloat *position, int range, int *lower, int *upper) {
+    int j;
+    GLfloat centre;
+    for (j = 0; j < 3; j++) {
+        centre = (position[j] + box_edge_size) / packed_step;
+        lower[j] = (int)floor(centre - range / packed_step - 1.0);
+        upper[j] = (int)ceil(centre + range / packed_step + 1.0);
+    }
+}
 
-        // Alter next_direction vectors of species 2.
-        if (two_species) {
-            for (i = 0; i < fish2_count; i++) {
-                initialise_vector(f2[i].next_direction_v);
-                update_in_ZOR(&f2[i], f1, fish1_count, ZOR_range_spec2[0]);
-                update_in_ZOR(&f2[i], f2, fish2_count, ZOR_range_spec2[1]);
-                // Only do ZOO,ZOA work if no fish were in the ZOR
-                if (!(f2[i].in_ZOR)) {
-                    update_in_ZOO_ZOA(&f2[i], f1, fish1_count, ZOO_range_spec2[0], ZOA_range_spec2[0]);
-                    update_in_ZOO_ZOA(&f2[i], f2, fish2_count, ZOO_range_spec2[1], ZOA_range_spec2[1]);
-                }
-            }
-        }
+// Checks if the codes of a packed fish lie within a window found by packed_window.
+// Offsets below lower wrap round to large unsigned values, so each axis is one comparison.
+int in_packed_window(struct packed_fish *p, int *lower, int *upper) {
+    return ((unsigned int)(p->position_q[0] - lower[0]) <= (unsigned int)(upper[0] - lower[0])) &
+        ((unsigned int)(p->position_q[1] - lower[1]) <= (unsigned int)(upper[1] - lower[1])) &
+        ((unsigned int)(p->position_q[2] - lower[2]) <= (unsigned int)(upper[2] - lower[2]));
+}
 
-        for (i = 0; i < fish1_count; i++) {
-            if (f1[i].in_ZOO) {
-                for (j = 0; j < 3; j++) {
-                    f1[i].next_direction_v[j] += f1[i].direction_v[j];
-                }
-            }
-            if (f1[i].in_ZOR || f1[i].in_ZOO || f1[i].in_ZOA) {
-                normalise_vector(f1[i].next_direction_v);
-                f1[i].in_ZOR = 0;
-                f1[i].in_ZOO = 0;
-                f1[i].in_ZOA = 0;
+// update_in_ZOR reading the neighbours from their packed copy.
+// Fish whose codes are further than zor away along an axis are passed over undecoded.
+// fish2 is only compared against, to skip the fish itself and to link schools.
+void update_in_ZOR_packed(struct fish *fish1, struct fish *fish2, struct packed_fish *packed, int fish_count, int zor) {
+    int i;
+    int lower[3], upper[3];
+    GLfloat position[3], vector[3];
+    int same_species = fish1 >= fish2 && fish1 < fish2 + fish_count;
+
+    neighbour_reads += fish_count;
+    packed_window(fish1->position_v, zor, lower, upper);
+    for (i = 0; i < fish_count; i++) {
+        if (fish1 != &fish2[i] && in_packed_window(&packed[i], lower, upper)) {
+            unpack_position(&packed[i], position);
+            calculate_direction_vector(fish1->position_v, position, vector);
+            if (calculate_distance(fish1->position_v, position) < zor &&
+                calculate_angle(fish1->direction_v, vector) < blind_radian_segment) {
+                fish1->zones |= ZONE_ZOR;
+                update_direction_vector(position, fish1->position_v, fish1->next_direction_v);
+                if (school_tracking && same_species)
+                    school_link(fish1, &fish2[i]);
             }
         }
-        if (two_species) {
-            for (i = 0; i < fish2_count; i++) {
-                if (f2[i].in_ZOO) {
+    }
+}
+
+// update_in_ZOO_ZOA reading the neighbours from their packed copy.
+// Fish further than the wider zone away along an axis are passed over undecoded, and headings
+// are only decoded for the neighbours in the zone of orientation.
+void update_in_ZOO_ZOA_packed(struct fish *fish1, struct fish *fish2, struct packed_fish *packed, int fish_count,
+    int zoo, int zoa) {
+    int i, j;
+    int lower[3], upper[3];
+    GLfloat dist;
+    GLfloat position[3], heading[3], vector[3];
+
+    neighbour_reads += fish_count;
+    packed_window(fish1->position_v, zoo > zoa ? zoo : zoa, lower, upper);
+    for (i = 0; i < fish_count; i++) {
+        if (fish1 != &fish2[i] && in_packed_window(&packed[i], lower, upper)) {
+            unpack_position(&packed[i], position);
+            calculate_direction_vector(fish1->position_v, position, vector);
+            if (calculate_angle(fish1->direction_v, vector) < blind_radian_segment) {
+                dist = calculate_distance(fish1->position_v, position);
+                if (dist < zoo) {
+                    fish1->zones |= ZONE_ZOO;
+                    unpack_heading(&packed[i], heading);
                     for (j = 0; j < 3; j++) {
-                        f2[i].next_direction_v[j] += f2[i].direction_v[j];
+                        fish1->next_direction_v[j] += heading[j];
                     }
+                    if (school_tracking)
+                        school_link(fish1, &fish2[i]);
                 }
-                if (f2[i].in_ZOR || f2[i].in_ZOO || f2[i].in_ZOA) {
-                    normalise_vector(f2[i].next_direction_v);
-                    f2[i].in_ZOR = 0;
-                    f2[i].in_ZOO = 0;
-                    f2[i].in_ZOA = 0;
+                else if (dist >= zoo && dist < zoa) {
+                    fish1->zones |= ZONE_ZOA;
+                    update_direction_vector(fish1->position_v, position, fish1->next_direction_v);
+                    if (school_tracking)
+                        school_link(fish1, &fish2[i]);
                 }
             }
         }
     }
-    glutPostRedisplay();
 }
 
-// Manages the window when it is reshaped    
-void reshape(int w, int h) {
-    glViewport(0, 0, (GLsizei)w, (GLsizei)h);
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    gluPerspective(50, (GLfloat)w / (GLfloat)h, 0.1, 1000);
-    glMatrixMode(GL_MODELVIEW);
-    width = w;
-    height = h;
-}
 
-// Changes the viewpoint and size of the "box"    
-void cursor_keys(int key, int x, int y) {
-    switch (key) {
-    case GLUT_KEY_RIGHT:
-        if (eyez == 0.0) {
-            eyez = box_edge_size + 65.0;
-            eyex = -box_edge_size - 65.0;
-        }
-        else {
-            eyex = 0.0;
-            eyez = dist_from_scene;
-        }
-        break;
-    case GLUT_KEY_LEFT:
-        if (eyex == 0.0) {
-            eyez = box_edge_size + 65.0;
-            eyex = -box_edge_size - 65.0;
-        }
-        else {
-            eyez = 0.0;
-            eyex = dist_from_scene * -1;
+// Sets lower and upper to the bounding box of an obstacle
+void calculate_obstacle_bounds(struct obstacle *o) {
+    int i, j;
+    for (j = 0; j < 3; j++) {
+        switch (o->type) {
+        case OBSTACLE_SPHERE:
+            o->lower[j] = o->v[0][j] - o->v[1][0];
+            o->upper[j] = o->v[0][j] + o->v[1][0];
+            break;
+        case OBSTACLE_BOX:
+            o->lower[j] = o->v[0][j];
+            o->upper[j] = o->v[1][j];
+            break;
+        default:
+            o->lower[j] = o->upper[j] = o->v[0][j];
+            for (i = 1; i < 3; i++) {
+                if (o->v[i][j] < o->lower[j])
+                    o->lower[j] = o->v[i][j];
+                if (o->v[i][j] > o->upper[j])
+                    o->upper[j] = o->v[i][j];
+            }
         }
-        break;
-    case GLUT_KEY_UP:
-        if (box_edge_size < MAX_BOX_EDGE)
-            box_edge_size++;
-        break;
-    case GLUT_KEY_DOWN:
-        if (box_edge_size > MIN_BOX_EDGE)
-            box_edge_size--;
-        break;
     }
 }
 
-// Allocates memory and initialises fish variables.
-void init(void) {
-    light_position0[0] = -box_edge_size;
-    light_position0[1] = light_position0[3] = 0.0;
-    light_position0[2] = box_edge_size;
-    glClearColor(1.0, 1.0, 1.0, 0.0);   /* Define background colour */
-    int i;
-    // Allocate memory for fish
-    while (f1 == NULL)
-        f1 = (struct fish*)malloc(sizeof(struct fish) * MAX_FISH);
-    while (f2 == NULL)
-        f2 = (struct fish*)malloc(sizeof(struct fish) * MAX_FISH);
-    // Initialise the fish
-    for (i = 0; i < MAX_FISH; i++) {
-        generate_vector(f1[i].position_v);
-        generate_vector(f1[i].direction_v);
-        normalise_vector(f1[i].direction_v);
-        initialise_vector(f1[i].next_direction_v);
-        f1[i].in_ZOR = 0;
-        f1[i].in_ZOO = 0;
-        f1[i].in_ZOA = 0;
-        generate_vector(f2[i].position_v);
-        generate_vector(f2[i].direction_v);
-        normalise_vector(f2[i].direction_v);
-        initialise_vector(f2[i].next_direction_v);
-        f2[i].in_ZOR = 0;
-        f2[i].in_ZOO = 0;
-        f2[i].in_ZOA = 0;
+// Appends an obstacle to the scene
+struct obstacle *add_obstacle(int type) {
+    struct obstacle *o;
+    if (obstacle_count == obstacle_capacity) {
+        obstacle_capacity = obstacle_capacity ? obstacle_capacity * 2 : 64;
+        obstacles = (struct obstacle*)realloc(obstacles, sizeof(struct obstacle) * obstacle_capacity);
+        if (obstacles == NULL) {
+            fprintf(stderr, "Out of memory for obstacles\n");
+            exit(1);
+        }
     }
-    blind_radian_segment = PI - (blind_angle * DEG_TO_RAD * 0.5);
+    o = &obstacles[obstacle_count++];
+    memset(o, 0, sizeof(*o));
+    o->type = type;
+    return o;
+}
+
+// Compares two obstacles by the centre of their bounds along bvh_sort_axis
+int compare_obstacle_centres(const void *a, const void *b) {
+    const struct obstacle *oa = (const struct obstacle*)a;
+    const struct obstacle *ob = (const struct obstacle*)b;
+    GLfloat ca = oa->lower[bvh_sort_axis] + oa->upper[bvh_sort_axis];
+    GLfloat cb = ob->lower[bvh_sort_axis] + ob->upper[bvh_sort_axis];
+    return (ca > cb) - (ca < cb);
+}
+
+// Builds the subtree over obstacles [first, first + count) and returns its node. The obstacles are
+// split at the median along the longest axis of their centres. A node's left child directly follows
+// it, so inner nodes only store the right child.
+int build_bvh_node(int first, int count) {
+    int node = bvh_node_count++;
+    int i, j, axis, half;
+    GLfloat centre, centre_lower[3], centre_upper[3];
+    struct bvh_node *n = &bvh_nodes[node];
+
+    for (j = 0; j < 3; j++) {
+        n->lower[j] = obstacles[first].lower[j];
+        n->upper[j] = obstacles[first].upper[j];
+        centre_lower[j] = centre_upper[j] = (obstacles[first].lower[j] + obstacles[first].upper[j]) * 0.5;
+    }
+    for (i = first + 1; i < first + count; i++) {
+        for (j = 0; j < 3; j++) {
+            if (obstacles[i].lower[j] < n->lower[j])
+                n->lower[j] = obstacles[i].lower[j];
+            if (obstacles[i].upper[j] > n->upper[j])
+                n->upper[j] = obstacles[i].upper[j];
+            centre = (obstacles[i].lower[j] + obstacles[i].upper[j]) * 0.5;
+            if (centre < centre_lower[j])
+                centre_lower[j] = centre;
+            if (centre > centre_upper[j])
+                centre_upper[j] = centre;
+        }
+    }
+    if (count <= BVH_LEAF_SIZE) {
+        n->first = first;
+        n->count = count;
+        return node;
+    }
+
+    axis = 0;
+    for (j = 1; j < 3; j++) {
+        if (centre_upper[j] - centre_lower[j] > centre_upper[axis] - centre_lower[axis])
+            axis = j;
+    }
+    bvh_sort_axis = axis;
+    qsort(&obstacles[first], count, sizeof(struct obstacle), compare_obstacle_centres);
+    half = count / 2;
+    n->count = 0;
+    build_bvh_node(first, half);
+    n->first = build_bvh_node(first + half, count - half);
+    return node;
+}
+
+// Builds the bounding volume hierarchy over all obstacles
+void build_bvh(void) {
+    int i;
+    free(bvh_nodes);
+    bvh_nodes = NULL;
+    bvh_node_count = 0;
+    if (obstacle_count == 0)
+        return;
+    for (i = 0; i < obstacle_count; i++)
+        calculate_obstacle_bounds(&obstacles[i]);
+    bvh_nodes = (struct bvh_node*)malloc(sizeof(struct bvh_node) * 2 * obstacle_count);
+    if (bvh_nodes == NULL) {
+        fprintf(stderr, "Out of memory for the obstacle hierarchy\n");
+        exit(1);
+    }
+    build_bvh_node(0, obstacle_count);
+}
+
+// Finds the point of triangle a b c closest to p (Ericson, Real-Time Collision Detection, 5.1.5)
+void closest_point_on_triangle(GLfloat *p, GLfloat *a, GLfloat *b, GLfloat *c, GLfloat *closest) {
+    GLfloat ab[3], ac[3], ap[3], bp[3], cp[3];
+    GLfloat d1, d2, d3, d4, d5, d6, va, vb, vc, v, w, denom;
+    int j;
+
+    calculate_direction_vector(a, b, ab);
+    calculate_direction_vector(a, c, ac);
+    calculate_direction_vector(a, p, ap);
+    d1 = calculate_dot_prod(ab, ap);
+    d2 = calculate_dot_prod(ac, ap);
+    if (d1 <= 0.0 && d2 <= 0.0) {
+        memcpy(closest, a, sizeof(GLfloat) * 3);
+        return;
+    }
+    calculate_direction_vector(b, p, bp);
+    d3 = calculate_dot_prod(ab, bp);
+    d4 = calculate_dot_prod(ac, bp);
+    if (d3 >= 0.0 && d4 <= d3) {
+        memcpy(closest, b, sizeof(GLfloat) * 3);
+        return;
+    }
+    vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0 && d1 >= 0.0 && d3 <= 0.0) {
+        v = d1 / (d1 - d3);
+        for (j = 0; j < 3; j++)
+            closest[j] = a[j] + v * ab[j];
+        return;
+    }
+    calculate_direction_vector(c, p, cp);
+    d5 = calculate_dot_prod(ab, cp);
+    d6 = calculate_dot_prod(ac, cp);
+    if (d6 >= 0.0 && d5 <= d6) {
+        memcpy(closest, c, sizeof(GLfloat) * 3);
+        return;
+    }
+    vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0 && d2 >= 0.0 && d6 <= 0.0) {
+        w = d2 / (d2 - d6);
+        for (j = 0; j < 3; j++)
+            closest[j] = a[j] + w * ac[j];
+        return;
+    }
+    va = d3 * d6 - d5 * d4;
+    if (va <= 0.0 && (d4 - d3) >= 0.0 && (d5 - d6) >= 0.0) {
+        w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+        for (j = 0; j < 3; j++)
+            closest[j] = b[j] + w * (c[j] - b[j]);
+        return;
+    }
+    denom = 1.0 / (va + vb + vc);
+    v = vb * denom;
+    w = vc * denom;
+    for (j = 0; j < 3; j++)
+        closest[j] = a[j] + ab[j] * v + ac[j] * w;
+}
+
+// Returns the distance from p to the surface of an obstacle, negative when p is inside it,
+// and sets away to a direction leading away from the surface
+GLfloat calculate_obstacle_distance(struct obstacle *o, GLfloat *p, GLfloat *away) {
+    GLfloat closest[3], dist, face;
+    int j, axis;
+
+    switch (o->type) {
+    case OBSTACLE_SPHERE:
+        calculate_direction_vector(o->v[0], p, away);
+        return calculate_magnitude(away) - o->v[1][0];
+    case OBSTACLE_BOX:
+        for (j = 0; j < 3; j++)
+            closest[j] = p[j] < o->v[0][j] ? o->v[0][j] : (p[j] > o->v[1][j] ? o->v[1][j] : p[j]);
+        calculate_direction_vector(closest, p, away);
+        if (!is_zero_vector(away))
+            return calculate_magnitude(away);
+        // Inside, so leave through the nearest face
+        axis = 0;
+        dist = -1.0;
+        for (j = 0; j < 3; j++) {
+            face = p[j] - o->v[0][j] < o->v[1][j] - p[j] ? p[j] - o->v[0][j] : o->v[1][j] - p[j];
+            if (dist < 0.0 || face < dist) {
+                dist = face;
+                axis = j;
+            }
+        }
+        initialise_vector(away);
+        away[axis] = p[axis] - o->v[0][axis] < o->v[1][axis] - p[axis] ? -1.0 : 1.0;
+        return -dist;
+    default:
+        closest_point_on_triangle(p, o->v[0], o->v[1], o->v[2], closest);
+        calculate_direction_vector(closest, p, away);
+        return calculate_magnitude(away);
+    }
+}
+
+// Returns the distance from p to a node's bounding box, 0 when inside it
+GLfloat calculate_bvh_distance(struct bvh_node *n, GLfloat *p) {
+    GLfloat d, sum = 0.0;
+    int j;
+    for (j = 0; j < 3; j++) {
+        d = p[j] < n->lower[j] ? n->lower[j] - p[j] : (p[j] > n->upper[j] ? p[j] - n->upper[j] : 0.0);
+        sum += d * d;
+    }
+    return sqrt(sum);
+}
+
+// Finds the obstacle surface nearest to p within range through the hierarchy.
+// Returns 1 and sets away to the direction leading away from it, or 0 when none is in range.
+int query_obstacles(GLfloat *p, GLfloat range, GLfloat *away) {
+    int stack[64];
+    GLfloat stack_dist[64]; // Distance to each stacked node, so popping needs no second test
+    int top = 0, node, near_child, far_child, i, found = 0;
+    GLfloat best = range, dist, near_dist, far_dist, direction[3];
+    struct bvh_node *n;
+
+    if (bvh_node_count == 0)
+        return 0;
+    stack[top] = 0;
+    stack_dist[top++] = calculate_bvh_distance(&bvh_nodes[0], p);
+    while (top > 0) {
+        top--;
+        if (stack_dist[top] >= best)
+            continue;
+        n = &bvh_nodes[stack[top]];
+        if (n->count > 0) {
+            for (i = n->first; i < n->first + n->count; i++) {
+                dist = calculate_obstacle_distance(&obstacles[i], p, direction);
+                if (dist < best && !is_zero_vector(direction)) {
+                    best = dist;
+                    memcpy(away, direction, sizeof(direction));
+                    found = 1;
+                }
+            }
+        }
+        else {
+            // Visit the nearer child first so it can tighten best before the other is tested
+            node = (int)(n - bvh_nodes);
+            near_child = node + 1;
+            far_child = n->first;
+            near_dist = calculate_bvh_distance(&bvh_nodes[near_child], p);
+            far_dist = calculate_bvh_distance(&bvh_nodes[far_child], p);
+            if (far_dist < near_dist) {
+                near_child = n->first;
+                far_child = node + 1;
+                dist = near_dist;
+                near_dist = far_dist;
+                far_dist = dist;
+            }
+            if (far_dist < best) {
+                stack[top] = far_child;
+                stack_dist[top++] = far_dist;
+            }
+            if (near_dist < best) {
+                stack[top] = near_child;
+                stack_dist[top++] = near_dist;
+            }
+        }
+    }
+    return found;
+}
+
+// Steers each fish away from the nearest obstacle within obstacle_range.
+// Like repulsion this takes priority over orientation and attraction.
+void avoid_obstacles(struct fish *f, int fish_count) {
+    int i, j;
+    GLfloat away[3];
+    for (i = 0; i < fish_count; i++) {
+        if (query_obstacles(f[i].position_v, obstacle_range, away)) {
+            normalise_vector(away);
+            f[i].zones |= ZONE_ZOR;
+            for (j = 0; j < 3; j++)
+                f[i].next_direction_v[j] += away[j];
+        }
+    }
+}
+
+// Steers a fish away from every predator within flee_radius
+void flee_predators(struct fish *fish1) {
+    int i;
+    for (i = 0; i < predator_count; i++) {
+        if (calculate_distance(fish1->position_v, predators[i].position_v) < flee_radius) {
+            fish1->zones |= ZONE_ZOR;
+            update_direction_vector(predators[i].position_v, fish1->position_v, fish1->next_direction_v);
+        }
+    }
+}
+
+// Points each predator's next direction at the nearest fish
+void hunt_fish(void) {
+    int i, k, count;
+    GLfloat dist, best;
+    struct fish *prey, *f;
+
+    for (i = 0; i < predator_count; i++) {
+        prey = NULL;
+        best = 0.0;
+        count = fish1_count + (two_species ? fish2_count : 0);
+        for (k = 0; k < count; k++) {
+            f = k < fish1_count ? &f1[k] : &f2[k - fish1_count];
+            dist = calculate_distance(predators[i].position_v, f->position_v);
+            if (prey == NULL || dist < best) {
+                prey = f;
+                best = dist;
+            }
+        }
+        initialise_vector(predators[i].next_direction_v);
+        if (prey != NULL && best > 0.0)
+            update_direction_vector(predators[i].position_v, prey->position_v, predators[i].next_direction_v);
+    }
+}
+
+// Reads obstacles and predators from a scene file. Each line is one of
+//   sphere x y z radius
+//   box min_x min_y min_z max_x max_y max_z
+//   v x y z                 a mesh vertex
+//   f a b c ...             a mesh face of 1-based (or negative, relative) vertex indices
+//   predator x y z
+// Faces with more than three vertices are split into a fan of triangles, so plain OBJ meshes load
+// too; any other line, such as OBJ normals or groups, is ignored.
+void load_scene(char *filename) {
+    FILE *file;
+    char line[1024], keyword[16], *cursor;
+    GLfloat (*vertices)[3] = NULL;
+    int vertex_count = 0, vertex_capacity = 0, line_number = 0, skipped = 0;
+    int index, face[3], corners, consumed, j, valid;
+    struct obstacle *o;
+
+    file = fopen(filename, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Cannot open %s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        if (sscanf(line, "%15s%n", keyword, &consumed) != 1 || keyword[0] == '#')
+            continue;
+        cursor = line + consumed;
+        valid = 1;
+        if (strcmp(keyword, "sphere") == 0) {
+            o = add_obstacle(OBSTACLE_SPHERE);
+            valid = sscanf(cursor, "%f %f %f %f", &o->v[0][0], &o->v[0][1], &o->v[0][2], &o->v[1][0]) == 4 &&
+                o->v[1][0] > 0.0;
+        }
+        else if (strcmp(keyword, "box") == 0) {
+            o = add_obstacle(OBSTACLE_BOX);
+            valid = sscanf(cursor, "%f %f %f %f %f %f", &o->v[0][0], &o->v[0][1], &o->v[0][2],
+                &o->v[1][0], &o->v[1][1], &o->v[1][2]) == 6;
+            for (j = 0; j < 3; j++) {
+                if (o->v[0][j] > o->v[1][j])
+                    valid = 0;
+            }
+        }
+        else if (strcmp(keyword, "v") == 0) {
+            if (vertex_count == vertex_capacity) {
+                vertex_capacity = vertex_capacity ? vertex_capacity * 2 : 256;
+                vertices = (GLfloat(*)[3])realloc(vertices, sizeof(GLfloat) * 3 * vertex_capacity);
+                if (vertices == NULL) {
+                    fprintf(stderr, "Out of memory for mesh vertices\n");
+                    exit(1);
+                }
+            }
+            valid = sscanf(cursor, "%f %f %f", &vertices[vertex_count][0], &vertices[vertex_count][1],
+                &vertices[vertex_count][2]) == 3;
+            vertex_count++;
+        }
+        else if (strcmp(keyword, "f") == 0) {
+            corners = 0;
+            // Each corner may be written as v, v/vt, v//vn or v/vt/vn; only v is used
+            while (valid && sscanf(cursor, " %d%n", &index, &consumed) == 1) {
+                cursor += consumed;
+                while (*cursor != '\0' && *cursor != ' ' && *cursor != '\t' && *cursor != '\n' && *cursor != '\r')
+                    cursor++;
+                if (index < 0)
+                    index += vertex_count + 1;
+                if (index < 1 || index > vertex_count) {
+                    valid = 0;
+                    break;
+                }
+                if (corners < 3) {
+                    face[corners++] = index - 1;
+                }
+                else {
+                    face[1] = face[2];
+                    face[2] = index - 1;
+                    corners++;
+                }
+                if (corners >= 3) {
+                    o = add_obstacle(OBSTACLE_TRIANGLE);
+                    for (j = 0; j < 3; j++)
+                        memcpy(o->v[j], vertices[face[j]], sizeof(GLfloat) * 3);
+                }
+            }
+            if (corners < 3)
+                valid = 0;
+        }
+        else if (strcmp(keyword, "predator") == 0) {
+            if (scene_predators == MAX_PREDATORS) {
+                fprintf(stderr, "%s:%d: more than %d predators\n", filename, line_number, MAX_PREDATORS);
+                exit(1);
+            }
+            valid = sscanf(cursor, "%f %f %f", &predator_start_v[scene_predators][0],
+                &predator_start_v[scene_predators][1], &predator_start_v[scene_predators][2]) == 3;
+            scene_predators++;
+        }
+        else {
+            skipped++;
+        }
+        if (!valid) {
+            fprintf(stderr, "%s:%d: malformed '%s' line\n", filename, line_number, keyword);
+            exit(1);
+        }
+    }
+    fclose(file);
+    free(vertices);
+    if (skipped > 0)
+        fprintf(stderr, "%s: ignored %d unrecognised lines\n", filename, skipped);
+    if (predator_count < scene_predators)
+        predator_count = scene_predators;
+    build_bvh();
+}
+
+// Repulsion pass of one fish of the given species: starts its next direction afresh and steers
+// it away from the fish in its zone of repulsion and from nearby predators
+void repel_fish(struct fish *fish, int species) {
+    int *zor = species == 1 ? ZOR_range_spec1 : ZOR_range_spec2;
+    initialise_vector(fish->next_direction_v);
+    if (compact_state) {
+        update_in_ZOR_packed(fish, f1, packed1, fish1_count, zor[0]);
+        if (two_species) {
+            update_in_ZOR_packed(fish, f2, packed2, fish2_count, zor[1]);
+        }
+    }
+    else {
+        update_in_ZOR(fish, f1, fish1_count, zor[0]);
+        if (two_species) {
+            update_in_ZOR(fish, f2, fish2_count, zor[1]);
+        }
+    }
+    flee_predators(fish);
+}
+
+// Orientation and attraction pass of one fish of the given species.
+// Only do ZOO,ZOA work if no fish were in the ZOR
+void align_fish(struct fish *fish, int species) {
+    int *zoo = species == 1 ? ZOO_range_spec1 : ZOO_range_spec2;
+    int *zoa = species == 1 ? ZOA_range_spec1 : ZOA_range_spec2;
+    if (!(fish->zones & ZONE_ZOR) && compact_state) {
+        update_in_ZOO_ZOA_packed(fish, f1, packed1, fish1_count, zoo[0], zoa[0]);
+        if (two_species) {
+            update_in_ZOO_ZOA_packed(fish, f2, packed2, fish2_count, zoo[1], zoa[1]);
+        }
+    }
+    else if (!(fish->zones & ZONE_ZOR)) {
+        update_in_ZOO_ZOA(fish, f1, fish1_count, zoo[0], zoa[0]);
+        if (two_species) {
+            update_in_ZOO_ZOA(fish, f2, fish2_count, zoo[1], zoa[1]);
+        }
+    }
+}
+
+// Resolves the next direction of one fish once every pass has run
+void finish_fish(struct fish *fish) {
+    int j;
+    if (fish->zones & ZONE_ZOO) {
+        for (j = 0; j < 3; j++) {
+            fish->next_direction_v[j] += fish->direction_v[j];
+        }
+    }
+    if (fish->zones) {
+        normalise_vector(fish->next_direction_v);
+        fish->zones = 0;
+    }
+}
+
+// Runs the interaction passes that determine the next direction of every fish.
+// The ZOR pass runs over every fish before the ZOO/ZOA pass so each can be timed on its own;
+// neither pass reads next_direction_v of other fish, so the result is the same as interleaving them.
+void steer_fish(void) {
+    int i;
+
+    // Alter next_direction vectors with regards to the zone of repulsion
+    phase_begin(PHASE_ZOR);
+    if (school_tracking)
+        begin_schools();
+    for (i = 0; i < fish1_count; i++) {
+        repel_fish(&f1[i], 1);
+    }
+    if (two_species) {
+        for (i = 0; i < fish2_count; i++) {
+            repel_fish(&f2[i], 2);
+        }
+    }
+    phase_end(PHASE_ZOR);
+
+    // Alter next_direction vectors with regards to the obstacles
+    if (obstacle_count > 0) {
+        phase_begin(PHASE_OBSTACLES);
+        avoid_obstacles(f1, fish1_count);
+        if (two_species) {
+            avoid_obstacles(f2, fish2_count);
+        }
+        phase_end(PHASE_OBSTACLES);
+    }
+
+    // Alter next_direction vectors with regards to the zones of orientation and attraction
+    phase_begin(PHASE_ZOO_ZOA);
+    for (i = 0; i < fish1_count; i++) {
+        align_fish(&f1[i], 1);
+    }
+    if (two_species) {
+        for (i = 0; i < fish2_count; i++) {
+            align_fish(&f2[i], 2);
+        }
+    }
+    for (i = 0; i < fish1_count; i++) {
+        finish_fish(&f1[i]);
+    }
+    if (two_species) {
+        for (i = 0; i < fish2_count; i++) {
+            finish_fish(&f2[i]);
+        }
+    }
+    phase_end(PHASE_ZOO_ZOA);
+}
+
+// Updates the positions and directions of the fish.
+// The passes work on one fish at a time against f1 and f2, which lets a decomposed run apply them
+// unchanged to the fish it owns.
+void update_fish(void) {
+    if (!paused) {
+        // Alter fish positions
+        phase_begin(PHASE_MOVE);
+        move_fish(f1, fish1_count, turning_radian_spec1, RNG_TURN_FALLBACK_SPEC1, &order_spec1);
+        if (two_species) {
+            move_fish(f2, fish2_count, turning_radian_spec2, RNG_TURN_FALLBACK_SPEC2, &order_spec2);
+        }
+        if (predator_count > 0) {
+            hunt_fish();
+            move_fish(predators, predator_count, turning_radian_predator, RNG_TURN_FALLBACK_PREDATOR, &order_predators);
+        }
+        if (compact_state)
+            pack_fish_state();
+        phase_end(PHASE_MOVE);
+
+        steer_fish();
+
+        if (school_tracking) {
+            phase_begin(PHASE_SCHOOLS);
+            finish_schools();
+            phase_end(PHASE_SCHOOLS);
+        }
+
+        sim_tick++;
+        if (metrics_file) {
+            write_order_metrics(1, &order_spec1);
+            if (two_species)
+                write_order_metrics(2, &order_spec2);
+        }
+        if (++stats_steps >= stats_interval)
+            report_stats(sim_tick);
+    }
+}
+
+// Idle function that paces the simulation at target_tps and drawing at target_fps.
+// When behind it runs several steps before the next frame, and when ahead it sleeps
+// until the next deadline instead of spinning.
+void schedule(void) {
+    double now = get_time_seconds();
+    double wake;
+    int steps = 0;
+
+    if (target_tps <= 0.0) {
+        update_fish();
+        window_steps++;
+        now = get_time_seconds();
+    }
+    else {
+        // Catch up, but never hold back a frame that is due for more than one step
+        while (now >= next_step_time && steps < MAX_STEPS_PER_FRAME && (steps == 0 || now < next_frame_time)) {
+            update_fish();
+            window_steps++;
+            steps++;
+            next_step_time += 1.0 / target_tps;
+            now = get_time_seconds();
+        }
+        // Too far behind to catch up, so slow the simulation down rather than fall further back
+        if (now >= next_step_time)
+            next_step_time = now;
+    }
+
+    if (now - rate_window_start >= 1.0) {
+        measured_tps = window_steps / (now - rate_window_start);
+        measured_fps = window_frames / (now - rate_window_start);
+        window_steps = window_frames = 0;
+        rate_window_start = now;
+    }
+
+    if (now >= next_frame_time) {
+        next_frame_time += 1.0 / target_fps;
+        if (next_frame_time < now)
+            next_frame_time = now + 1.0 / target_fps;
+        glutPostRedisplay();
+        return;
+    }
+    if (target_tps > 0.0) {
+        wake = next_step_time < next_frame_time ? next_step_time : next_frame_time;
+        sleep_until(wake);
+    }
+}
+
+// Pauses or resumes the simulation. While paused no idle function is registered,
+// so the program only wakes up for window and keyboard events.
+void set_paused(int state) {
+    double now = get_time_seconds();
+    paused = state;
+    next_step_time = next_frame_time = rate_window_start = now;
+    window_steps = window_frames = 0;
+    measured_tps = 0.0;
+    glutIdleFunc(paused ? NULL : schedule);
+}
+
+// Manages the window when it is reshaped    
+void reshape(int w, int h) {
+    glViewport(0, 0, (GLsizei)w, (GLsizei)h);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    gluPerspective(50, (GLfloat)w / (GLfloat)h, 0.1, 1000);
+    glMatrixMode(GL_MODELVIEW);
+    width = w;
+    height = h;
+}
+
+// Changes the viewpoint and size of the "box"    
+void cursor_keys(int key, int x, int y) {
+    switch (key) {
+    case GLUT_KEY_RIGHT:
+        if (eyez == 0.0) {
+            eyez = box_edge_size + 65.0;
+            eyex = -box_edge_size - 65.0;
+        }
+        else {
+            eyex = 0.0;
+            eyez = dist_from_scene;
+        }
+        break;
+    case GLUT_KEY_LEFT:
+        if (eyex == 0.0) {
+            eyez = box_edge_size + 65.0;
+            eyex = -box_edge_size - 65.0;
+        }
+        else {
+            eyez = 0.0;
+            eyex = dist_from_scene * -1;
+        }
+        break;
+    case GLUT_KEY_UP:
+        if (box_edge_size < MAX_BOX_EDGE)
+            box_edge_size++;
+        break;
+    case GLUT_KEY_DOWN:
+        if (box_edge_size > MIN_BOX_EDGE)
+            box_edge_size--;
+        break;
+    }
+    glutPostRedisplay();
+}
+
+// Resizes the storage of a species to hold count fish, in whole chunks of FISH_CHUNK.
+// The fish stay in one array so the passes walk them contiguously. It grows to at least double,
+// so spawning fish one at a time costs amortised constant time, and gives memory back only once
+// under a quarter is in use, so spawning and removing around a boundary does not thrash.
+// Returns 0, leaving the storage as it was, when memory runs out; the school arrays may have
+// grown by then, which is harmless.
+int reserve_fish(int species, int count) {
+    struct fish **f = species == 1 ? &f1 : &f2;
+    struct packed_fish **packed = species == 1 ? &packed1 : &packed2;
+    int *capacity = species == 1 ? &fish1_capacity : &fish2_capacity;
+    long long wanted = ((long long)count + FISH_CHUNK - 1) / FISH_CHUNK * FISH_CHUNK;
+    struct fish *resized;
+    struct packed_fish *resized_packed;
+
+    if (count <= *capacity && (count >= *capacity / 4 || *capacity <= FISH_CHUNK))
+        return 1;
+    if (count > *capacity && wanted < 2LL * *capacity)
+        wanted = 2LL * *capacity;
+    else if (count <= *capacity)
+        wanted = wanted * 2 > FISH_CHUNK ? wanted * 2 : FISH_CHUNK;
+    if (wanted == *capacity)
+        return 1;
+    if (wanted > INT_MAX / 2)
+        return 0;
+    // School labels of existing fish stay valid as long as the school arrays never shrink
+    if (wanted - *capacity + fish1_capacity + fish2_capacity > school_capacity &&
+        !allocate_schools((int)(wanted - *capacity + fish1_capacity + fish2_capacity)))
+        return 0;
+    resized = (struct fish*)realloc(*f, sizeof(struct fish) * (size_t)wanted);
+    if (resized == NULL)
+        return 0;
+    *f = resized;
+    resized_packed = (struct packed_fish*)realloc(*packed, sizeof(struct packed_fish) * (size_t)wanted);
+    if (resized_packed == NULL) {
+        // A shrunk array of fish still bounds the storage even though the packed copy kept its size
+        if (wanted < *capacity)
+            *capacity = (int)wanted;
+        return 0;
+    }
+    *packed = resized_packed;
+    *capacity = (int)wanted;
+    return 1;
+}
+
+// Gives a fish a fresh identifier and a random position and heading drawn from its own counters
+void place_fish(struct fish *fish, unsigned int id, unsigned int stream) {
+    fish->id = id;
+    generate_vector(fish->position_v, stream, fish->id, 0);
+    generate_vector(fish->direction_v, stream, fish->id, 1);
+    normalise_vector(fish->direction_v);
+    initialise_vector(fish->next_direction_v);
+    fish->zones = 0;
+    fish->school = SCHOOL_NONE;
+}
+
+// Adds one fish to the end of a species, leaving every other fish as it is.
+// Returns the new fish, or NULL when memory runs out.
+struct fish *spawn_fish(int species) {
+    int *count = species == 1 ? &fish1_count : &fish2_count;
+    unsigned int *next_id = species == 1 ? &fish1_next_id : &fish2_next_id;
+    struct fish *fish;
+
+    if (!reserve_fish(species, *count + 1))
+        return NULL;
+    fish = (species == 1 ? f1 : f2) + *count;
+    place_fish(fish, (*next_id)++, species == 1 ? RNG_INIT_SPEC1 : RNG_INIT_SPEC2);
+    (*count)++;
+    return fish;
+}
+
+// Removes the fish at index from a species by moving the last fish into its place,
+// which keeps the storage dense at the cost of the order of the fish
+void despawn_fish(int species, int index) {
+    struct fish *f = species == 1 ? f1 : f2;
+    int *count = species == 1 ? &fish1_count : &fish2_count;
+
+    f[index] = f[--(*count)];
+    reserve_fish(species, *count);
+}
+
+// Removes a fish picked at random from a species.
+// Each removal draws on its own counter, so removals within one tick, as when paused, differ.
+void despawn_random_fish(int species) {
+    int count = species == 1 ? fish1_count : fish2_count;
+    unsigned int *despawns = species == 1 ? &fish1_despawns : &fish2_despawns;
+    uint32_t words[4];
+
+    if (count == 0)
+        return;
+    generate_random_block(species == 1 ? RNG_DESPAWN_SPEC1 : RNG_DESPAWN_SPEC2, (*despawns)++, 0, words);
+    despawn_fish(species, (int)(words[0] % (uint32_t)count));
+}
+
+// Allocates memory and initialises fish variables.
+// Needs no window, so headless runs call it directly.
+void init_fish(void) {
+    int i;
+    // Allocate memory for fish
+    if (!reserve_fish(1, fish1_count) || !reserve_fish(2, fish2_count)) {
+        fprintf(stderr, "Out of memory for %d and %d fish\n", fish1_count, fish2_count);
+        exit(1);
+    }
+    // Initialise the fish. Every fish draws from its own counters, so the loop can run in parallel.
+    sim_tick = 0;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for (i = 0; i < fish1_count; i++) {
+        place_fish(&f1[i], i, RNG_INIT_SPEC1);
+    }
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for (i = 0; i < fish2_count; i++) {
+        place_fish(&f2[i], i, RNG_INIT_SPEC2);
+    }
+    fish1_next_id = fish1_count;
+    fish2_next_id = fish2_count;
+    fish1_despawns = fish2_despawns = 0;
+    for (i = 0; i < predator_count; i++) {
+        predators[i].id = i;
+        if (i < scene_predators)
+            memcpy(predators[i].position_v, predator_start_v[i], sizeof(predator_start_v[i]));
+        else
+            generate_vector(predators[i].position_v, RNG_INIT_PREDATOR, predators[i].id, 0);
+        generate_vector(predators[i].direction_v, RNG_INIT_PREDATOR, predators[i].id, 1);
+        normalise_vector(predators[i].direction_v);
+        initialise_vector(predators[i].next_direction_v);
+        predators[i].zones = 0;
+        predators[i].school = SCHOOL_NONE;
+    }
+    if (!allocate_schools(fish1_capacity + fish2_capacity)) {
+        fprintf(stderr, "Out of memory for %d and %d fish\n", fish1_count, fish2_count);
+        exit(1);
+    }
+    school_count = largest_school = school_merges = school_splits = 0;
+    blind_radian_segment = PI - (blind_angle * DEG_TO_RAD * 0.5);
     hard_wall = 1;
-    pause = 0;
+    paused = 0;
+}
+
+// Initialises the fish, the viewpoint and the lighting.
+void init(void) {
+    light_position0[0] = -box_edge_size;
+    light_position0[1] = light_position0[3] = 0.0;
+    light_position0[2] = box_edge_size;
+    glClearColor(1.0, 1.0, 1.0, 0.0);   /* Define background colour */
+    init_fish();
     eyex = -box_edge_size - 65.0;
     eyey = 0.0;
     eyez = box_edge_size + 65.0;
@@ -693,12 +2352,18 @@ void init(void) {
 void keyboard(unsigned char key, int x, int y) {
     switch (key) {
     case 27:
+        if (metrics_file)
+            fclose(metrics_file);
         free(f1);
         free(f2);
+        free(packed1);
+        free(packed2);
         exit(0);
         break;
     case 'q':
+        restart_count++;
         init();
+        set_paused(0);
         break;
     case 'a':
         hard_wall = !hard_wall;
@@ -707,23 +2372,18 @@ void keyboard(unsigned char key, int x, int y) {
         two_species = !two_species;
         break;
     case '[':
-        if (fish1_count > 0) {
-            fish1_count--;
-        }
+        despawn_random_fish(1);
         break;
     case ']':
-        if (fish1_count < MAX_FISH)
-            fish1_count++;
+        spawn_fish(1);
         break;
     case '{':
         if (two_species)
-            if (fish2_count > 0)
-                fish2_count--;
+            despawn_random_fish(2);
         break;
     case '}':
         if (two_species)
-            if (fish2_count < MAX_FISH)
-                fish2_count++;
+            spawn_fish(2);
         break;
     case 'e':
         if (ZOR_range_spec1[0] > 0)
@@ -837,23 +2497,820 @@ void keyboard(unsigned char key, int x, int y) {
         if (turning_angle_spec2 < 10)
             turning_radian_spec2 = (turning_angle_spec2++) * DEG_TO_RAD;
         break;
+    case '-':
+        if (target_tps > 1.0)
+            target_tps /= 2.0;
+        break;
+    case '+':
+    case '=':
+        if (target_tps > 0.0 && target_tps < 1000.0)
+            target_tps *= 2.0;
+        break;
+    case 'g':
+        colour_schools = !colour_schools;
+        break;
     case 'p':
-        pause = !pause;
+        set_paused(!paused);
+        break;
+    }
+    glutPostRedisplay();
+}
+
+#ifndef _WIN32
+// Returns the process owning the slab of the box that x lies in
+int rank_of(GLfloat x) {
+    int rank = (int)((x + box_edge_size) / slab_width);
+    if (rank < 0)
+        return 0;
+    if (rank >= ranks)
+        return ranks - 1;
+    return rank;
+}
+
+// Orders fish handed between processes by species, then by slot
+int compare_rank_fish(const void *a, const void *b) {
+    const struct rank_fish *ra = (const struct rank_fish*)a;
+    const struct rank_fish *rb = (const struct rank_fish*)b;
+    if (ra->species != rb->species)
+        return ra->species - rb->species;
+    return ra->slot - rb->slot;
+}
+
+// Returns the widest zone in use, which is as far as a fish can see across a slab face
+int calculate_halo_width(void) {
+    int i, width = 0;
+    int *ranges[] = { ZOR_range_spec1, ZOO_range_spec1, ZOA_range_spec1, ZOR_range_spec2, ZOO_range_spec2, ZOA_range_spec2 };
+    for (i = 0; i < 6; i++) {
+        if (ranges[i][0] > width && (i < 3 || two_species))
+            width = ranges[i][0];
+        if (ranges[i][1] > width && two_species)
+            width = ranges[i][1];
+    }
+    return width;
+}
+
+// Returns a capacity of at least RANK_CHUNK, doubled until it holds count elements
+int grow_rank_capacity(int capacity, int count) {
+    if (capacity < RANK_CHUNK)
+        capacity = RANK_CHUNK;
+    while (capacity < count)
+        capacity *= 2;
+    return capacity;
+}
+
+// Resizes an array local to one process of a decomposed run, ending the process when memory runs out
+void *resize_rank_array(void *array, int capacity, size_t size) {
+    array = realloc(array, size * (size_t)capacity);
+    if (array == NULL) {
+        fprintf(stderr, "Out of memory in a process of the decomposed run\n");
+        exit(1);
+    }
+    return array;
+}
+
+// Makes room for count owned fish of species s
+void reserve_rank_own(struct rank_state *state, int s, int count) {
+    if (count <= state->own_capacity[s])
+        return;
+    state->own_capacity[s] = grow_rank_capacity(state->own_capacity[s], count);
+    state->own[s] = (struct fish*)resize_rank_array(state->own[s], state->own_capacity[s], sizeof(struct fish));
+    state->own_slot[s] = (int*)resize_rank_array(state->own_slot[s], state->own_capacity[s], sizeof(int));
+}
+
+// Makes room for count owned and ghost fish of species s in the view
+void reserve_rank_view(struct rank_state *state, int s, int count) {
+    if (count <= state->view_capacity[s])
+        return;
+    state->view_capacity[s] = grow_rank_capacity(state->view_capacity[s], count);
+    state->view[s] = (struct fish*)resize_rank_array(state->view[s], state->view_capacity[s], sizeof(struct fish));
+    state->view_own[s] = (int*)resize_rank_array(state->view_own[s], state->view_capacity[s], sizeof(int));
+}
+
+// Makes room for count fish received from the other processes
+void reserve_rank_incoming(struct rank_state *state, int count) {
+    if (count <= state->incoming_capacity)
+        return;
+    state->incoming_capacity = grow_rank_capacity(state->incoming_capacity, count);
+    state->incoming = (struct rank_fish*)resize_rank_array(state->incoming, state->incoming_capacity,
+        sizeof(struct rank_fish));
+}
+
+// Creates the shared memory object of one list before the processes start, so they all inherit it.
+// The name is unlinked at once, so the object goes away with the last process that has it open.
+void open_rank_channel(struct rank_channel *channel, int index, int *capacity) {
+    char name[64];
+    snprintf(name, sizeof(name), "/fish-%ld-%d", (long)getpid(), index);
+    channel->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (channel->fd == -1) {
+        fprintf(stderr, "Cannot create shared memory: %s\n", strerror(errno));
+        exit(1);
+    }
+    shm_unlink(name);
+    if (ftruncate(channel->fd, (off_t)sizeof(struct rank_fish) * RANK_CHUNK) == -1) {
+        fprintf(stderr, "Cannot size shared memory: %s\n", strerror(errno));
+        exit(1);
+    }
+    channel->fish = NULL;
+    channel->mapped = 0;
+    *capacity = RANK_CHUNK;
+}
+
+// Returns this process's mapping of a list, mapping it again when its owner has grown it.
+// Lists only grow, so a reader's older, shorter mapping still covers what it read before.
+struct rank_fish *map_rank_channel(struct rank_channel *channel, int capacity) {
+    void *memory;
+    if (capacity > channel->mapped) {
+        if (channel->fish != NULL)
+            munmap(channel->fish, sizeof(struct rank_fish) * (size_t)channel->mapped);
+        memory = mmap(NULL, sizeof(struct rank_fish) * (size_t)capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+            channel->fd, 0);
+        if (memory == MAP_FAILED) {
+            fprintf(stderr, "Cannot map shared memory: %s\n", strerror(errno));
+            exit(1);
+        }
+        channel->fish = (struct rank_fish*)memory;
+        channel->mapped = capacity;
+    }
+    return channel->fish;
+}
+
+// Makes room for count fish in a list this process publishes, growing its shared memory object.
+// The new capacity is published in the shared header for the readers to map after the barrier.
+struct rank_fish *reserve_rank_channel(struct rank_channel *channel, int *capacity, int count) {
+    int wanted;
+    if (count > *capacity) {
+        wanted = grow_rank_capacity(*capacity, count);
+        if (ftruncate(channel->fd, (off_t)sizeof(struct rank_fish) * wanted) == -1) {
+            fprintf(stderr, "Cannot grow shared memory: %s\n", strerror(errno));
+            exit(1);
+        }
+        *capacity = wanted;
+    }
+    return map_rank_channel(channel, *capacity);
+}
+
+// Merges the owned and ghost fish of one species, both ordered by slot, into the view the passes
+// run over, and records where the owned fish ended up
+void build_rank_view(struct rank_state *state, int s, struct rank_fish *ghost, int ghost_count) {
+    int i = 0, k = 0, n = 0;
+    reserve_rank_view(state, s, state->own_count[s] + ghost_count);
+    while (i < state->own_count[s] || k < ghost_count) {
+        if (k == ghost_count || (i < state->own_count[s] && state->own_slot[s][i] < ghost[k].slot)) {
+            state->view_own[s][i] = n;
+            state->view[s][n++] = state->own[s][i++];
+        }
+        else {
+            state->view[s][n++] = ghost[k++].fish;
+        }
+    }
+    state->view_count[s] = n;
+}
+
+// Runs one step on the fish this process owns, exchanging fish through shared memory:
+// move the owned fish, hand those that left the slab to their new owner, publish the fish
+// within halo_width of a slab face, then run the update_fish passes over owned and ghost fish
+void step_rank(struct rank_state *state) {
+    int s, i, k, q, n, count, first, last;
+    struct rank_fish *out, *in;
+    GLfloat x;
+    struct fish *saved_f1 = f1, *saved_f2 = f2;
+    int saved_count1 = fish1_count, saved_count2 = fish2_count;
+    struct order_metrics unused;
+
+    move_fish(state->own[0], state->own_count[0], turning_radian_spec1, RNG_TURN_FALLBACK_SPEC1, &unused);
+    move_fish(state->own[1], state->own_count[1], turning_radian_spec2, RNG_TURN_FALLBACK_SPEC2, &unused);
+
+    // Hand the fish that left the slab to their new owner
+    count = 0;
+    for (s = 0; s < 2; s++) {
+        for (i = 0; i < state->own_count[s]; i++) {
+            if (rank_of(state->own[s][i].position_v[0]) != state->rank)
+                count++;
+        }
+    }
+    out = reserve_rank_channel(&rank_migrants[state->rank], &rank_shared->migrant_capacity[state->rank], count);
+    count = 0;
+    for (s = 0; s < 2; s++) {
+        n = 0;
+        for (i = 0; i < state->own_count[s]; i++) {
+            if (rank_of(state->own[s][i].position_v[0]) != state->rank) {
+                out[count].fish = state->own[s][i];
+                out[count].species = s;
+                out[count++].slot = state->own_slot[s][i];
+            }
+            else {
+                state->own[s][n] = state->own[s][i];
+                state->own_slot[s][n++] = state->own_slot[s][i];
+            }
+        }
+        state->own_count[s] = n;
+    }
+    rank_shared->migrant_count[state->rank] = count;
+    pthread_barrier_wait(&rank_shared->barrier);
+
+    count = 0;
+    for (q = 0; q < ranks; q++) {
+        if (q != state->rank)
+            count += rank_shared->migrant_count[q];
+    }
+    reserve_rank_incoming(state, count);
+    count = 0;
+    for (q = 0; q < ranks; q++) {
+        if (q == state->rank || rank_shared->migrant_count[q] == 0)
+            continue;
+        in = map_rank_channel(&rank_migrants[q], rank_shared->migrant_capacity[q]);
+        for (i = 0; i < rank_shared->migrant_count[q]; i++) {
+            if (rank_of(in[i].fish.position_v[0]) == state->rank)
+                state->incoming[count++] = in[i];
+        }
+    }
+    // Merge the arrivals into the owned fish from the back, keeping them ordered by slot
+    qsort(state->incoming, count, sizeof(struct rank_fish), compare_rank_fish);
+    first = 0;
+    for (s = 0; s < 2; s++) {
+        last = first;
+        while (last < count && state->incoming[last].species == s)
+            last++;
+        reserve_rank_own(state, s, state->own_count[s] + (last - first));
+        i = state->own_count[s] - 1;
+        n = state->own_count[s] + (last - first);
+        state->own_count[s] = n;
+        k = last;
+        while (k > first) {
+            if (i >= 0 && state->own_slot[s][i] > state->incoming[k - 1].slot) {
+                state->own[s][--n] = state->own[s][i];
+                state->own_slot[s][n] = state->own_slot[s][i--];
+            }
+            else {
+                state->own[s][--n] = state->incoming[--k].fish;
+                state->own_slot[s][n] = state->incoming[k].slot;
+            }
+        }
+        first = last;
+    }
+
+    // Publish the fish a neighbouring slab can see
+    count = 0;
+    for (s = 0; s < 2; s++) {
+        for (i = 0; i < state->own_count[s]; i++) {
+            x = state->own[s][i].position_v[0];
+            if (x < state->lower + halo_width || x >= state->upper - halo_width)
+                count++;
+        }
+    }
+    out = reserve_rank_channel(&rank_halos[state->rank], &rank_shared->halo_capacity[state->rank], count);
+    count = 0;
+    for (s = 0; s < 2; s++) {
+        for (i = 0; i < state->own_count[s]; i++) {
+            x = state->own[s][i].position_v[0];
+            if (x < state->lower + halo_width || x >= state->upper - halo_width) {
+                out[count].fish = state->own[s][i];
+                out[count].species = s;
+                out[count++].slot = state->own_slot[s][i];
+            }
+        }
+    }
+    rank_shared->halo_count[state->rank] = count;
+    pthread_barrier_wait(&rank_shared->barrier);
+
+    count = 0;
+    for (q = 0; q < ranks; q++) {
+        if (q != state->rank)
+            count += rank_shared->halo_count[q];
+    }
+    reserve_rank_incoming(state, count);
+    count = 0;
+    for (q = 0; q < ranks; q++) {
+        if (q == state->rank || rank_shared->halo_count[q] == 0)
+            continue;
+        in = map_rank_channel(&rank_halos[q], rank_shared->halo_capacity[q]);
+        for (i = 0; i < rank_shared->halo_count[q]; i++) {
+            x = in[i].fish.position_v[0];
+            if (x > state->lower - halo_width && x < state->upper + halo_width)
+                state->incoming[count++] = in[i];
+        }
+    }
+    qsort(state->incoming, count, sizeof(struct rank_fish), compare_rank_fish);
+    k = 0;
+    while (k < count && state->incoming[k].species == 0)
+        k++;
+    build_rank_view(state, 0, state->incoming, k);
+    build_rank_view(state, 1, state->incoming + k, count - k);
+
+    // Run the passes of update_fish on the owned fish against the views
+    f1 = state->view[0];
+    fish1_count = state->view_count[0];
+    f2 = state->view[1];
+    fish2_count = state->view_count[1];
+    if (compact_state)
+        pack_fish_state();
+    for (i = 0; i < state->own_count[0]; i++)
+        repel_fish(&f1[state->view_own[0][i]], 1);
+    for (i = 0; i < state->own_count[1]; i++)
+        repel_fish(&f2[state->view_own[1][i]], 2);
+    for (i = 0; i < state->own_count[0]; i++)
+        avoid_obstacles(&f1[state->view_own[0][i]], 1);
+    for (i = 0; i < state->own_count[1]; i++)
+        avoid_obstacles(&f2[state->view_own[1][i]], 1);
+    for (i = 0; i < state->own_count[0]; i++)
+        align_fish(&f1[state->view_own[0][i]], 1);
+    for (i = 0; i < state->own_count[1]; i++)
+        align_fish(&f2[state->view_own[1][i]], 2);
+    for (s = 0; s < 2; s++) {
+        for (i = 0; i < state->own_count[s]; i++) {
+            finish_fish(&state->view[s][state->view_own[s][i]]);
+            state->own[s][i] = state->view[s][state->view_own[s][i]];
+        }
+    }
+    f1 = saved_f1;
+    fish1_count = saved_count1;
+    f2 = saved_f2;
+    fish2_count = saved_count2;
+    sim_tick++;
+}
+
+// Body of one process of a decomposed run
+void run_rank(int rank, int steps) {
+    struct rank_state state;
+    int s, i, t, counts[2];
+    struct fish *all[2];
+
+    counts[0] = fish1_count;
+    counts[1] = two_species ? fish2_count : 0;
+    all[0] = f1;
+    all[1] = f2;
+    memset(&state, 0, sizeof(state));
+    state.rank = rank;
+    state.lower = -box_edge_size + rank * slab_width;
+    state.upper = state.lower + slab_width;
+    for (s = 0; s < 2; s++) {
+        for (i = 0; i < counts[s]; i++) {
+            if (rank_of(all[s][i].position_v[0]) == rank)
+                state.own_count[s]++;
+        }
+        reserve_rank_own(&state, s, state.own_count[s]);
+        state.own_count[s] = 0;
+        for (i = 0; i < counts[s]; i++) {
+            if (rank_of(all[s][i].position_v[0]) == rank) {
+                state.own[s][state.own_count[s]] = all[s][i];
+                state.own_slot[s][state.own_count[s]++] = i;
+            }
+        }
+    }
+
+    for (t = 0; t < steps; t++)
+        step_rank(&state);
+
+    for (s = 0; s < 2; s++) {
+        for (i = 0; i < state.own_count[s]; i++)
+            rank_results[(s == 0 ? 0 : counts[0]) + state.own_slot[s][i]] = state.own[s][i];
+    }
+}
+
+// Splits the box into slabs along x, one per process, and runs the given number of steps.
+// Only the header and the gathered result are mapped up front; the lists the processes
+// exchange fish through start small and grow with what each process publishes.
+// The final state is gathered back into f1 and f2.
+void run_decomposed(int steps) {
+    size_t size;
+    char *memory;
+    pthread_barrierattr_t attr;
+    pid_t pids[MAX_RANKS], pid;
+    int rank, status, failed = 0, i;
+
+    if (predator_count > 0) {
+        fprintf(stderr, "Decomposed runs do not support predators\n");
+        exit(1);
+    }
+    // Schools need every fish, which no single process has
+    school_tracking = 0;
+    slab_width = 2.0 * box_edge_size / ranks;
+    halo_width = calculate_halo_width();
+
+    size = sizeof(struct rank_shared) + sizeof(struct fish) * (size_t)(fish1_count + (two_species ? fish2_count : 0));
+    memory = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        fprintf(stderr, "Cannot map shared memory: %s\n", strerror(errno));
+        exit(1);
+    }
+    rank_shared = (struct rank_shared*)memory;
+    rank_results = (struct fish*)(memory + sizeof(struct rank_shared));
+    for (rank = 0; rank < ranks; rank++) {
+        open_rank_channel(&rank_halos[rank], 2 * rank, &rank_shared->halo_capacity[rank]);
+        open_rank_channel(&rank_migrants[rank], 2 * rank + 1, &rank_shared->migrant_capacity[rank]);
+    }
+    pthread_barrierattr_init(&attr);
+    pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_barrier_init(&rank_shared->barrier, &attr, ranks);
+    pthread_barrierattr_destroy(&attr);
+
+    fflush(stdout);
+    for (rank = 0; rank < ranks; rank++) {
+        pid = fork();
+        if (pid == -1) {
+            fprintf(stderr, "Cannot start process %d: %s\n", rank, strerror(errno));
+            exit(1);
+        }
+        if (pid == 0) {
+            run_rank(rank, steps);
+            _exit(0);
+        }
+        pids[rank] = pid;
+    }
+    // A process that fails leaves the others waiting at a barrier, so stop them all
+    for (rank = 0; rank < ranks; rank++) {
+        if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            if (!failed) {
+                for (i = 0; i < ranks; i++)
+                    kill(pids[i], SIGTERM);
+            }
+            failed = 1;
+        }
+    }
+    if (failed) {
+        fprintf(stderr, "A process of the decomposed run failed\n");
+        exit(1);
+    }
+
+    for (i = 0; i < fish1_count; i++)
+        f1[i] = rank_results[i];
+    for (i = 0; two_species && i < fish2_count; i++)
+        f2[i] = rank_results[fish1_count + i];
+    sim_tick += steps;
+    for (rank = 0; rank < ranks; rank++) {
+        close(rank_halos[rank].fd);
+        close(rank_migrants[rank].fd);
+    }
+    pthread_barrier_destroy(&rank_shared->barrier);
+    munmap(memory, size);
+}
+#endif
+
+// Compares the state of fish against reference, printing how many differ and by how much.
+// Returns the number of fish that are not bit-identical.
+int compare_fish(char *name, struct fish *f, struct fish *reference, int count) {
+    int i, j, differ = 0;
+    GLdouble deviation, max_deviation = 0.0;
+    for (i = 0; i < count; i++) {
+        if (memcmp(f[i].position_v, reference[i].position_v, sizeof(f[i].position_v)) != 0 ||
+            memcmp(f[i].direction_v, reference[i].direction_v, sizeof(f[i].direction_v)) != 0 ||
+            memcmp(f[i].next_direction_v, reference[i].next_direction_v, sizeof(f[i].next_direction_v)) != 0)
+            differ++;
+        for (j = 0; j < 3; j++) {
+            deviation = fabs(f[i].position_v[j] - reference[i].position_v[j]);
+            if (deviation > max_deviation)
+                max_deviation = deviation;
+        }
+    }
+    printf("check %s: %d of %d fish differ, largest position deviation %g\n", name, differ, count, max_deviation);
+    return differ;
+}
+
+// Calculates the angle between two vectors in double precision, from atan2 of the lengths of their
+// cross and dot products, which neither needs unit vectors nor loses small angles to rounding
+// the way acos of a float dot product does
+GLdouble calculate_precise_angle(GLfloat *v1, GLfloat *v2) {
+    GLdouble cross[3], dot;
+    cross[0] = (GLdouble)v1[1] * v2[2] - (GLdouble)v1[2] * v2[1];
+    cross[1] = (GLdouble)v1[2] * v2[0] - (GLdouble)v1[0] * v2[2];
+    cross[2] = (GLdouble)v1[0] * v2[1] - (GLdouble)v1[1] * v2[0];
+    dot = (GLdouble)v1[0] * v2[0] + (GLdouble)v1[1] * v2[1] + (GLdouble)v1[2] * v2[2];
+    return atan2(sqrt(cross[0] * cross[0] + cross[1] * cross[1] + cross[2] * cross[2]), dot);
+}
+
+// Measures the error the packed copy introduces into one species: how far the decoded positions
+// and headings are from the fish, and how far the next directions steered from the packed copy
+// are from reference, steered at full precision from the same state
+void measure_compact_error(struct fish *f, struct packed_fish *packed, struct fish *reference, int count,
+    GLdouble *max_position, GLdouble *max_heading, GLdouble *sum_turn, GLdouble *max_turn, long *turns, long *flips) {
+    int i, j;
+    GLfloat v[3];
+    GLdouble error;
+    for (i = 0; i < count; i++) {
+        unpack_position(&packed[i], v);
+        for (j = 0; j < 3; j++) {
+            error = fabs(v[j] - f[i].position_v[j]);
+            if (error > *max_position)
+                *max_position = error;
+        }
+        unpack_heading(&packed[i], v);
+        error = calculate_precise_angle(v, f[i].direction_v);
+        if (error > *max_heading)
+            *max_heading = error;
+        if (is_zero_vector(f[i].next_direction_v) != is_zero_vector(reference[i].next_direction_v)) {
+            (*flips)++;
+        }
+        else if (!is_zero_vector(f[i].next_direction_v)) {
+            error = calculate_precise_angle(f[i].next_direction_v, reference[i].next_direction_v);
+            *sum_turn += error;
+            if (error > *max_turn)
+                *max_turn = error;
+            (*turns)++;
+        }
+    }
+}
+
+// Runs batch_steps steps on one path from the given start, for the order the school reaches
+void run_compact_path(int compact, struct fish *initial1, struct fish *initial2) {
+    memcpy(f1, initial1, sizeof(struct fish) * fish1_count);
+    memcpy(f2, initial2, sizeof(struct fish) * fish2_count);
+    compact_state = compact;
+    sim_tick = 0;
+    while (sim_tick < (unsigned long)batch_steps)
+        update_fish();
+}
+
+// Compares the packed path against full precision over batch_steps steps. Each step the full
+// precision path moves the fish, then both paths steer them from that same state, so the error
+// does not compound and both are timed on the same work. Each path then runs on its own to
+// compare the order the school reaches.
+void run_compact_report(void) {
+    struct fish *initial1, *initial2, *reference1, *reference2;
+    GLdouble max_position = 0.0, max_heading = 0.0, sum_turn = 0.0, max_turn = 0.0;
+    long turns = 0, flips = 0;
+    int tracking = school_tracking;
+    double start, full_seconds = 0.0, packed_seconds = 0.0;
+    long long full_reads = 0, packed_reads = 0;
+    int population = fish1_count + (two_species ? fish2_count : 0);
+    struct order_metrics full_order1, full_order2;
+
+    initial1 = (struct fish*)malloc(sizeof(struct fish) * (fish1_count + 1));
+    initial2 = (struct fish*)malloc(sizeof(struct fish) * (fish2_count + 1));
+    reference1 = (struct fish*)malloc(sizeof(struct fish) * (fish1_count + 1));
+    reference2 = (struct fish*)malloc(sizeof(struct fish) * (fish2_count + 1));
+    if (initial1 == NULL || initial2 == NULL || reference1 == NULL || reference2 == NULL) {
+        fprintf(stderr, "Out of memory for the report\n");
+        exit(1);
+    }
+    memcpy(initial1, f1, sizeof(struct fish) * fish1_count);
+    memcpy(initial2, f2, sizeof(struct fish) * fish2_count);
+
+    compact_state = 0;
+    while (sim_tick < (unsigned long)batch_steps) {
+        update_fish();
+        memcpy(reference1, f1, sizeof(struct fish) * fish1_count);
+        memcpy(reference2, f2, sizeof(struct fish) * fish2_count);
+        school_tracking = 0;
+        neighbour_reads = 0;
+        start = get_time_seconds();
+        steer_fish();
+        full_seconds += get_time_seconds() - start;
+        full_reads += neighbour_reads;
+        compact_state = 1;
+        neighbour_reads = 0;
+        start = get_time_seconds();
+        pack_fish_state();
+        steer_fish();
+        packed_seconds += get_time_seconds() - start;
+        packed_reads += neighbour_reads;
+        measure_compact_error(f1, packed1, reference1, fish1_count, &max_position, &max_heading,
+            &sum_turn, &max_turn, &turns, &flips);
+        if (two_species)
+            measure_compact_error(f2, packed2, reference2, fish2_count, &max_position, &max_heading,
+                &sum_turn, &max_turn, &turns, &flips);
+        memcpy(f1, reference1, sizeof(struct fish) * fish1_count);
+        memcpy(f2, reference2, sizeof(struct fish) * fish2_count);
+        school_tracking = tracking;
+        compact_state = 0;
+    }
+
+    run_compact_path(0, initial1, initial2);
+    full_order1 = order_spec1;
+    full_order2 = order_spec2;
+    run_compact_path(1, initial1, initial2);
+
+    printf("state read per neighbour: %d bytes full, %d bytes packed\n",
+        (int)sizeof(struct fish), (int)sizeof(struct packed_fish));
+    printf("quantisation: position step %g, largest position error %g, largest heading error %g deg\n",
+        packed_step, max_position, max_heading / DEG_TO_RAD);
+    printf("next direction: mean error %g deg, largest %g deg over %ld fish-steps, %ld turned on one path only\n",
+        turns ? sum_turn / turns / DEG_TO_RAD : 0.0, max_turn / DEG_TO_RAD, turns, flips);
+    printf("steering passes: %.3f ms a step full precision, %.3f ms packed including packing\n",
+        full_seconds * 1000.0 / batch_steps, packed_seconds * 1000.0 / batch_steps);
+    printf("neighbour state: %.2f MB full, %.2f MB packed, streamed at %.2f GB/s full, %.2f GB/s packed\n",
+        population * (double)sizeof(struct fish) / 1e6, population * (double)sizeof(struct packed_fish) / 1e6,
+        full_reads * (double)sizeof(struct fish) / full_seconds / 1e9,
+        packed_reads * (double)sizeof(struct packed_fish) / packed_seconds / 1e9);
+    printf("species 1 after %d steps: polarisation %.3f, milling %.3f full precision; %.3f, %.3f packed\n",
+        batch_steps, full_order1.polarisation, full_order1.milling, order_spec1.polarisation, order_spec1.milling);
+    if (two_species) {
+        printf("species 2 after %d steps: polarisation %.3f, milling %.3f full precision; %.3f, %.3f packed\n",
+            batch_steps, full_order2.polarisation, full_order2.milling, order_spec2.polarisation, order_spec2.milling);
+    }
+    free(initial1);
+    free(initial2);
+    free(reference1);
+    free(reference2);
+}
+
+// Runs batch_steps steps without a window, decomposed over several processes when ranks > 1,
+// and with -check compares the result against a single-process run from the same start
+void run_headless(void) {
+    double start, seconds;
+    struct fish *initial1 = NULL, *initial2 = NULL, *result1, *result2;
+    int differ;
+
+    init_fish();
+    if (compact_report) {
+        run_compact_report();
+        return;
+    }
+    if (check_decomposition) {
+        initial1 = (struct fish*)malloc(sizeof(struct fish) * (fish1_count + 1));
+        initial2 = (struct fish*)malloc(sizeof(struct fish) * (fish2_count + 1));
+        if (initial1 == NULL || initial2 == NULL) {
+            fprintf(stderr, "Out of memory for the check\n");
+            exit(1);
+        }
+        memcpy(initial1, f1, sizeof(struct fish) * fish1_count);
+        memcpy(initial2, f2, sizeof(struct fish) * fish2_count);
+    }
+
+    start = get_time_seconds();
+    if (ranks > 1) {
+#ifndef _WIN32
+        run_decomposed(batch_steps);
+#else
+        fprintf(stderr, "Decomposed runs need POSIX shared memory and fork\n");
+        exit(1);
+#endif
+    }
+    else {
+        while (sim_tick < (unsigned long)batch_steps)
+            update_fish();
+    }
+    seconds = get_time_seconds() - start;
+    printf("%d steps of %d fish on %d process%s in %.3f s (%.1f steps/s)\n", batch_steps,
+        fish1_count + (two_species ? fish2_count : 0), ranks, ranks > 1 ? "es" : "", seconds, batch_steps / seconds);
+
+    if (check_decomposition) {
+        result1 = f1;
+        result2 = f2;
+        f1 = initial1;
+        f2 = initial2;
+        sim_tick = 0;
+        school_tracking = 1;
+        start = get_time_seconds();
+        while (sim_tick < (unsigned long)batch_steps)
+            update_fish();
+        printf("single process reference in %.3f s\n", get_time_seconds() - start);
+        differ = compare_fish("species 1", result1, f1, fish1_count);
+        if (two_species)
+            differ += compare_fish("species 2", result2, f2, fish2_count);
+        exit(differ ? 1 : 0);
+    }
+}
+
+// Prints the command line options
+void print_usage(char *program) {
+    fprintf(stderr, "Usage: %s [options]\n", program);
+    fprintf(stderr, "  -stats           print per-phase step statistics every %d steps\n", stats_interval);
+    fprintf(stderr, "  -perf            add hardware counters to the statistics (implies -stats)\n");
+    fprintf(stderr, "  -tps N           simulation steps per second, 0 for as fast as possible (default %.0f)\n", target_tps);
+    fprintf(stderr, "  -fps N           frames drawn per second (default %.0f)\n", target_fps);
+    fprintf(stderr, "  -metrics FILE    write polarisation, milling, centroid and dispersion per step as CSV\n");
+    fprintf(stderr, "  -scene FILE      load obstacles (spheres, boxes, OBJ-style meshes) and predators\n");
+    fprintf(stderr, "  -avoid R         distance within which fish avoid obstacles (default %.0f)\n", obstacle_range);
+    fprintf(stderr, "  -predators N     number of predators, including those placed by the scene (max %d)\n", MAX_PREDATORS);
+    fprintf(stderr, "  -flee R          distance within which fish flee from predators (default %.0f)\n", flee_radius);
+    fprintf(stderr, "  -fish1 N         number of species one fish at the start\n");
+    fprintf(stderr, "  -fish2 N         number of species two fish at the start\n");
+    fprintf(stderr, "  -two-species     start with the second species activated\n");
+    fprintf(stderr, "  -steps N         run N steps without a window and exit\n");
+    fprintf(stderr, "  -ranks N         split a headless run into N processes owning slabs of the box (max %d)\n", MAX_RANKS);
+    fprintf(stderr, "  -check           compare a headless run against a single-process run\n");
+    fprintf(stderr, "  -compact         read neighbours from a quantised 10-byte copy of the fish\n");
+    fprintf(stderr, "  -compact-report  compare a headless run of the quantised copy against full precision\n");
+    fprintf(stderr, "  -seed N          seed of the random number generator (default %llu)\n", seed);
+}
+
+// Reads the command line options, passing over those GLUT reads itself.
+// Parsed before glutInit, so headless runs never open a display.
+void parse_arguments(int argc, char **argv) {
+    int i;
+    for (i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-display") == 0 || strcmp(argv[i], "-geometry") == 0) && i + 1 < argc) {
+            i++;
+        }
+        else if (strcmp(argv[i], "-iconic") == 0 || strcmp(argv[i], "-indirect") == 0 || strcmp(argv[i], "-direct") == 0 ||
+            strcmp(argv[i], "-gldebug") == 0 || strcmp(argv[i], "-sync") == 0) {
+            continue;
+        }
+        else if (strcmp(argv[i], "-stats") == 0) {
+            show_stats = 1;
+        }
+        else if (strcmp(argv[i], "-perf") == 0) {
+            show_stats = 1;
+            use_perf = 1;
+        }
+        else if (strcmp(argv[i], "-tps") == 0 && i + 1 < argc) {
+            target_tps = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-fps") == 0 && i + 1 < argc) {
+            target_fps = atof(argv[++i]);
+            if (target_fps <= 0.0) {
+                print_usage(argv[0]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "-metrics") == 0 && i + 1 < argc) {
+            metrics_file = fopen(argv[++i], "w");
+            if (metrics_file == NULL) {
+                fprintf(stderr, "Cannot open %s: %s\n", argv[i], strerror(errno));
+                exit(1);
+            }
+            fprintf(metrics_file, "step,species,count,polarisation,milling,centroid_x,centroid_y,centroid_z,dispersion\n");
+        }
+        else if (strcmp(argv[i], "-scene") == 0 && i + 1 < argc) {
+            load_scene(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-avoid") == 0 && i + 1 < argc) {
+            obstacle_range = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-predators") == 0 && i + 1 < argc) {
+            predator_count = atoi(argv[++i]);
+            if (predator_count < scene_predators)
+                predator_count = scene_predators;
+            if (predator_count < 0 || predator_count > MAX_PREDATORS) {
+                print_usage(argv[0]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "-flee") == 0 && i + 1 < argc) {
+            flee_radius = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-fish1") == 0 && i + 1 < argc) {
+            fish1_count = atoi(argv[++i]);
+            if (fish1_count < 0) {
+                print_usage(argv[0]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "-fish2") == 0 && i + 1 < argc) {
+            fish2_count = atoi(argv[++i]);
+            if (fish2_count < 0) {
+                print_usage(argv[0]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "-two-species") == 0) {
+            two_species = 1;
+        }
+        else if (strcmp(argv[i], "-steps") == 0 && i + 1 < argc) {
+            batch_steps = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-ranks") == 0 && i + 1 < argc) {
+            ranks = atoi(argv[++i]);
+            if (ranks < 1 || ranks > MAX_RANKS) {
+                print_usage(argv[0]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "-check") == 0) {
+            check_decomposition = 1;
+        }
+        else if (strcmp(argv[i], "-compact") == 0) {
+            compact_state = 1;
+        }
+        else if (strcmp(argv[i], "-compact-report") == 0) {
+            compact_report = 1;
+        }
+        else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 0);
+        }
+        else {
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+    // Statistics and order metrics need every fish, which no single process of a decomposed run has
+    if (ranks > 1 && (show_stats || metrics_file)) {
+        fprintf(stderr, "Decomposed runs do not support -stats, -perf or -metrics\n");
+        print_usage(argv[0]);
+        exit(1);
     }
 }
 
 // Main method    
 int main(int argc, char** argv) {
+    parse_arguments(argc, argv);
+    if (use_perf)
+        open_perf_counters();
+    turning_radian_spec1 = turning_angle_spec1 * DEG_TO_RAD;
+    turning_radian_spec2 = turning_angle_spec2 * DEG_TO_RAD;
+    turning_radian_predator = turning_angle_predator * DEG_TO_RAD;
+    if (batch_steps > 0) {
+        run_headless();
+        return 0;
+    }
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
     glutInitWindowSize(width, height);
     glutCreateWindow("Simulation of fish motion");
    // glutFullScreen();
-    turning_radian_spec1 = turning_angle_spec1 * DEG_TO_RAD;
-    turning_radian_spec2 = turning_angle_spec2 * DEG_TO_RAD;
     init();
     glutDisplayFunc(display);
-    glutIdleFunc(update_fish);
+    set_paused(0);
     glutReshapeFunc(reshape);
     glutKeyboardFunc(keyboard);
     glutSpecialFunc(cursor_keys);